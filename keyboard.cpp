@@ -6,6 +6,8 @@
 #include <avr/pgmspace.h>   /* required by usbdrv.h */
 #include <string.h>
 #include <keyboard/Keyboard.h>
+#include <keyboard/boot.h>
+#include <keyboard/timer.h>
 #include <keyboard/uart.h>
 
 #include "usb/descriptor_kbd.h"
@@ -20,16 +22,206 @@ extern "C" {
 /* ------------------------------------------------------------------------- */
 /* ----------------------------- USB interface ----------------------------- */
 
-/* repeat rate for keyboards, never used for mice */
-static uchar idleRate[3] = {0};
-static uchar idleTime[3] = {0};
 static keyboard::report_type type = keyboard::report_type::none;
 static keyboard::keyhandler keyboard_handler;
 
 /* ------------------------------------------------------------------------- */
+/* ------------------------------ Idle reports ----------------------------- */
+
+/* Idle rate per report in units of 4ms, 0 means only report on change.
+ * TIMER1 counts idleTime down and flags expired reports in idleExpired, the
+ * main loop then queues the current state again. The timer interrupt is
+ * only enabled while at least one rate is set. */
+static constexpr uchar idleReports = 3;
+static uchar idleRate[idleReports] = {0};
+static volatile uchar idleTime[idleReports] = {0};
+static volatile uchar idleExpired = 0;
+
+static constexpr keyboard::report_type idleReportType[idleReports] = {
+	keyboard::report_type::key,
+	keyboard::report_type::media,
+	keyboard::report_type::system,
+};
+
+static uchar idleIndex(uchar reportId) {
+	switch (static_cast<keyboard::report_type>(reportId)) {
+		case keyboard::report_type::boot:
+		case keyboard::report_type::key:
+		case keyboard::report_type::nkro:
+			return 0;
+		case keyboard::report_type::media:
+			return 1;
+		case keyboard::report_type::system:
+			return 2;
+		default:
+			return idleReports;
+	}
+}
+
+static void setIdle(uchar index, uchar rate) {
+	idleRate[index] = rate;
+	idleTime[index] = rate;
+
+	uchar active = 0;
+	for (uchar i = 0; i < idleReports; i++) {
+		active |= idleRate[i];
+	}
+	TIMSK1 = active ? _BV(OCIE1A) : 0;
+}
+
+static void idleReload(keyboard::report_type sent) {
+	// Any report sent restarts its idle period
+	uchar i = idleIndex(as_byte(sent));
+	if (i < idleReports) {
+		idleTime[i] = idleRate[i];
+	}
+}
+
+static void idlePoll() {
+	if (!idleExpired) {
+		return;
+	}
+	cli();
+	uchar expired = idleExpired;
+	idleExpired = 0;
+	sei();
+	for (uchar i = 0; i < idleReports; i++) {
+		if (expired & _BV(i)) {
+			keyboard_handler.send_report_intr(idleReportType[i]);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Suspend / resume --------------------------- */
+
+/* The bus is suspended once no SOF arrived for 3ms. TIMER0 counts the ms
+ * since the last SOF, the main loop then powers down until bus activity
+ * or, if the host armed remote wakeup, a key press wakes it up again. The
+ * USB state is kept, so there is no re-enumeration. */
+static bool remoteWakeup = false;
+
+#if KEYBOARD_REMOTE_WAKEUP
+/* The driver handles standard requests itself, peek at the ones for the
+ * remote wakeup feature on their way in */
+extern "C" void usbRxHook(const uchar *data, uchar len) {
+	constexpr uchar featureRemoteWakeup = 1;
+	if (len != 8 || data[0] != (USBRQ_TYPE_STANDARD | USBRQ_RCPT_DEVICE) ||
+	  data[2] != featureRemoteWakeup) {
+		return;
+	}
+	if (data[1] == USBRQ_SET_FEATURE) {
+		remoteWakeup = true;
+	} else if (data[1] == USBRQ_CLEAR_FEATURE) {
+		remoteWakeup = false;
+	}
+}
+
+extern "C" void usbResetHook() {
+	remoteWakeup = false;
+}
+
+// The received byte itself is lost, the UART stood still
+static volatile bool keyWake = false;
+ISR(PCINT0_vect) {
+	keyWake = true;
+}
+
+static void signalWakeup() {
+	// The bus must have been idle for 5ms, then drive K for 1-15ms
+	_delay_ms(2);
+	cli();
+	USBOUT = (USBOUT & ~USBMASK) | _BV(USBPLUS);
+	USBDDR |= USBMASK;
+	_delay_ms(10);
+	USBDDR &= ~USBMASK;
+	USBOUT &= ~USBMASK;
+	// Do not take our own signalling for a packet
+	USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT);
+	sei();
+}
+#endif
+
+static bool waitSof(uchar timeout) {
+	uchar sof = usbSofCount;
+	timer::sof_idle = 0;
+	while (timer::sof_idle < timeout) {
+		usbPoll();
+		if (usbSofCount != sof) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void suspend() {
+	keyboard_handler.suspend(remoteWakeup);
+	wdt_disable();
+
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	for (;;) {
+#if KEYBOARD_REMOTE_WAKEUP
+		// A make code from the keyboard toggles RXLIN
+		bool wakeup = remoteWakeup;
+		if (wakeup) {
+			keyWake = false;
+			PCMSK0 = _BV(PCINT0);
+			PCIFR = _BV(PCIF0);
+			PCICR |= _BV(PCIE0);
+		}
+#endif
+		cli();
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+#if KEYBOARD_REMOTE_WAKEUP
+		if (wakeup) {
+			PCICR &= ~_BV(PCIE0);
+			if (keyWake) {
+				signalWakeup();
+				// The host resumes the bus for 20ms after this
+				waitSof(50);
+				break;
+			}
+		}
+#endif
+		// Timer0 stood still while powered down, so resume counting here
+		if (waitSof(timer::suspend_timeout)) {
+			break;
+		}
+	}
+
+	keyboard_handler.resume();
+	wdt_enable(WDTO_15MS);
+}
+
+/* ------------------------------------------------------------------------- */
+/* With the media endpoint the consumer and system reports are on interface 1.
+ * Report ID 0 there stands for the first report of that interface. Returns
+ * report_type::none for reports the interface does not have. */
+static uchar requestInterface = 0;
+
+static keyboard::report_type interfaceReport(uchar interface, uchar reportId) {
+	auto type = static_cast<keyboard::report_type>(reportId);
+	if (!keyboard::features::media_endpoint) {
+		return type;
+	}
+	bool media = type == keyboard::report_type::media || type == keyboard::report_type::system;
+	if (interface == 1) {
+		if (type == keyboard::report_type::boot) {
+			return keyboard::report_type::media;
+		}
+		return media ? type : keyboard::report_type::none;
+	}
+	return media ? keyboard::report_type::none : type;
+}
+
 uchar usbFunctionWrite(uchar *data, uchar len) {
 	/* Only one report type to consider, which is one byte exactly */
-	if (len == sizeof(keyboard::led_report_t) &&
+	if (keyboard::features::media_endpoint && requestInterface != 0) {
+		// The media interface has no output report
+	} else if (len == sizeof(keyboard::led_report_t) &&
 	  static_cast<keyboard::report_type>(data[0]) == keyboard::report_type::key) {
 		keyboard_handler.set_led_report(data[1]);
 	} else if (len == 1 && keyboard_handler.get_protocol() == keyboard::keyhandler::protocol_boot) {
@@ -45,32 +237,49 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 
 	if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {    /* class request type */
 		/* wValue: ReportType (highbyte), ReportID (lowbyte) */
-		/* we only have one report type, so don't look at wValue */
-		type = static_cast<const keyboard::report_type>(rq->wValue.bytes[0]);
+		/* wIndex: interface */
+		requestInterface = rq->wIndex.bytes[0];
+		type = interfaceReport(requestInterface, rq->wValue.bytes[0]);
 		if (rq->bRequest == USBRQ_HID_GET_REPORT) {
+			if (type == keyboard::report_type::none) {
+				return 0;
+			}
 			return keyboard_handler.set_report_ptr(&usbMsgPtr, rq->wValue.bytes[1], type);
 		} else if (rq->bRequest == USBRQ_HID_SET_REPORT) {
 			// Let usbFunctionWrite take care of things
 			return USB_NO_MSG;
 		} else if (rq->bRequest == USBRQ_HID_GET_IDLE) {
-			if (type == keyboard::report_type::boot) {
-				usbMsgPtr = &idleRate[0];
-			} else {
-				usbMsgPtr = &idleRate[rq->wValue.bytes[0] - 1];
+			uchar i = idleIndex(as_byte(type));
+			if (i >= idleReports) {
+				return 0;
 			}
+			usbMsgPtr = &idleRate[i];
 			return 1;
 		} else if (rq->bRequest == USBRQ_HID_SET_IDLE) {
-			if (type == keyboard::report_type::boot) {
-				idleTime[0] = idleRate[0] = rq->wValue.bytes[1];
+			// Report ID 0 applies to all reports of the interface
+			if (rq->wValue.bytes[0] == 0) {
+				for (uchar i = 0; i < idleReports; i++) {
+					if (interfaceReport(requestInterface, as_byte(idleReportType[i])) != keyboard::report_type::none) {
+						setIdle(i, rq->wValue.bytes[1]);
+					}
+				}
 			} else {
-				idleRate[rq->wValue.bytes[0] - 1] =
-					idleRate[rq->wValue.bytes[0] - 1] = rq->wValue.bytes[1];
+				uchar i = idleIndex(as_byte(type));
+				if (i < idleReports) {
+					setIdle(i, rq->wValue.bytes[1]);
+				}
 			}
 		} else if (rq->bRequest == USBRQ_HID_GET_PROTOCOL) {
+			// Only the keyboard interface has a boot protocol
+			if (requestInterface != 0) {
+				return 0;
+			}
 			usbMsgPtr = &keyboard_handler.get_protocol();
 			return 1;
 		} else if (rq->bRequest == USBRQ_HID_SET_PROTOCOL) {
-			keyboard_handler.set_protocol(rq->wValue.bytes[0]);
+			if (requestInterface == 0) {
+				keyboard_handler.set_protocol(rq->wValue.bytes[0]);
+			}
 		}
 	}
 	return 0; // No data returned
@@ -80,45 +289,72 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
 
 
 void initTimer() {
-	TCCR0A = _BV(WGM01);
-	TCCR0B = _BV(CS01) | _BV(CS00); // freq = F_CPU/1024
-	OCR0A = 0x10; // Compare 16, INTR_freq = freq/16r
+	TCCR0A = _BV(WGM01); // Simple CTC timer
+	TCCR0B = _BV(CS01) | _BV(CS00); // prescale 64
+	OCR0A = F_CPU / 64 / 1000 - 1; // Compare every 1ms
 	TIMSK0 = _BV(OCIE0A);
 
 	TCCR1A = _BV(WGM12); // Simple CTC timer
 	TCCR1B = _BV(WGM12) | _BV(CS12); // Simple CTC timer, prescale 256
 	OCR1A = 2500; // Compare at 2500, meaning 4ms delay
-	TIMSK1 = _BV(OCIE1A);
+	TIMSK1 = 0; // Enabled by SET_IDLE
 }
 
-// Watchdog used to perform soft-reset on USB timeout
-// (15ms is the min., USB specifies suspend already after 3ms)
 static volatile uchar prevSofCount = 0;
+static volatile bool sleeping = false;
+volatile uint16_t timer::ms = 0;
+volatile uint16_t timer::idle_ticks = 0;
+volatile uint16_t timer::busy_ticks = 0;
+volatile uint8_t timer::sof_idle = 0;
+uint16_t boot::stamps[static_cast<uint8_t>(boot::stage::count)] = {0};
 ISR(TIMER0_COMPA_vect) {
-    // Once every ~1ms
+	// Once every 1ms
+	timer::ms = timer::ms + 1;
+	if (sleeping) {
+		timer::idle_ticks = timer::idle_ticks + 1;
+	} else {
+		timer::busy_ticks = timer::busy_ticks + 1;
+	}
 	if (prevSofCount != usbSofCount) {
-		wdt_reset();
 		prevSofCount = usbSofCount;
+		timer::sof_idle = 0;
+	} else if (timer::sof_idle != 0xFF) {
+		timer::sof_idle = timer::sof_idle + 1;
 	}
 }
 
 ISR(TIMER1_COMPA_vect) {
-	// Once every 4ms
-	for (uint8_t i = 0; i < 3; i++) {
-		if (idleTime[i] > 1) {
-			idleTime[i]--;
-		} else if (idleTime[i] == 1) {
-			if (usbInterruptIsReady()) {
-				// Disable interrupt until report is sent
-				TIMSK1 = 0;
-				//keyboard_handler.send_report_intr(static_cast<keyboard::report_type>(i));
-				idleTime[i] = idleRate[i];
-				TIMSK1 = _BV(OCIE1A);
+	// Once every 4ms, reports are sent from the main loop
+	for (uint8_t i = 0; i < idleReports; i++) {
+		uint8_t time = idleTime[i];
+		if (time != 0) {
+			if (--time == 0) {
+				idleExpired |= _BV(i);
+				time = idleRate[i];
 			}
+			idleTime[i] = time;
 		}
 	}
 }
 
+/* Sleep until the next interrupt when the last loop left nothing to do.
+ * Every source of work (USB, LIN, EEPROM, the timers) is an interrupt, so
+ * the loop runs again right after it without added latency. */
+static void idleSleep() {
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if (usbRxLen > 0 || idleExpired || !keyboard_handler.idle()) {
+		sei();
+		return;
+	}
+	sleeping = true;
+	sleep_enable();
+	sei(); // Executes the next instruction before taking an interrupt
+	sleep_cpu();
+	sleep_disable();
+	sleeping = false;
+}
+
 static void usbReset() {
 	cli();
 	usbDeviceDisconnect();
@@ -136,6 +372,10 @@ static void usbReset() {
 
 int main()
 {
+	// After a watchdog reset the handler carries on with its old state.
+	// WDRF keeps the watchdog on, so clear it before disabling.
+	bool warm = (MCUSR & _BV(WDRF)) && keyboard::warm::valid();
+	MCUSR = 0;
 	wdt_disable();
 	cli();
 
@@ -144,10 +384,6 @@ int main()
 	ADCSRA = 0;
 	PRR = _BV(PRLIN) | _BV(PRSPI) | _BV(PRTIM1) | _BV(PRTIM0) | _BV(PRUSI) | _BV(PRADC);
 
-	// Clear reset status flag
-	MCUSR = 0;
-
-
 	// Enable USB interrupts and go to sleep immediately, waking up
 	// on USB activity
 	usbDeviceConnect();
@@ -170,18 +406,38 @@ int main()
 	// Init peripheries
 	initTimer();
 	uart::init(1200);
-	keyboard_handler.init();
+	keyboard_handler.init(warm);
 
-	// Wait for configuration to be set. Only then enable kbd and draw power
+	// Wait for configuration to be set. Only then enable kbd and draw
+	// power, unless it fits the 100mA allowed before that. The self-test
+	// then runs while the host enumerates.
+	if (keyboard::features::early_power) {
+		keyboard_handler.enable();
+	}
 	while(usbConfiguration != 1) {
 		usbPoll();
+		if (keyboard::features::early_power) {
+			keyboard_handler.poll_event();
+		}
 	}
+	boot::mark(boot::stage::configured);
 
 	keyboard_handler.enable();
 
+	// Watchdog resets the chip should the main loop hang
 	wdt_enable(WDTO_15MS);
 	for(;;) {                /* main event loop */
+		wdt_reset();
 		usbPoll();
+		if (timer::sof_idle >= timer::suspend_timeout) {
+			suspend();
+		}
 		keyboard_handler.poll_event();
+		idlePoll();
+		idleReload(keyboard_handler.flush_reports());
+#if KEYBOARD_MEDIA_ENDPOINT
+		idleReload(keyboard_handler.flush_media_reports());
+#endif
+		idleSleep();
 	}
 }
@@ -3,12 +3,13 @@
 //
 
 #include "Keyboard.h"
+#include "eeprom_queue.h"
 #include "keymap.h"
+#include "timer.h"
 
 #include <avr/eeprom.h>
 #include <avr/wdt.h>
 #include <stddef.h>
-#include <util/delay.h>
 
 #define DIM(x) (sizeof(x)/sizeof(x[0]))
 
@@ -16,6 +17,7 @@ extern "C" {
 	uint16_t StackCount(void);
 }
 
+#if KEYBOARD_MORSE
 namespace morse {
 	extern const PROGMEM uint8_t codes[36] = {
 			0b010'01000, //a
@@ -57,55 +59,292 @@ namespace morse {
 			0b101'11111, //0
 	};
 }
+#endif
 
 namespace keyboard {
-	EEMEM uint8_t macro1[macro_large];
-	EEMEM uint8_t macro1_size = 0;
-	EEMEM uint8_t macro2[macro_large];
-	EEMEM uint8_t macro2_size = 0;
-	EEMEM uint8_t macro3[macro_small];
-	EEMEM uint8_t macro3_size = 0;
-	EEMEM uint8_t macro4[macro_small];
-	EEMEM uint8_t macro4_size = 0;
-
-	KeyUsage read_keymap(uint8_t c) {
-		if (c > DIM(keyboard::keymap_eeprom)) {
-			return KeyUsage::RESERVED;
+#if KEYBOARD_MACROS
+	static_assert(sizeof(macro_heap) + sizeof(keymap_overrides) + 2 <= E2END + 1, "Macros do not fit in EEPROM");
+
+	namespace {
+		// Keys with an Fn function, any other key can hold a macro
+		bool fn_bound(uint8_t c) {
+			switch (c) {
+				case ::keyboard::keys::f1:
+				case ::keyboard::keys::cut:
+				case ::keyboard::keys::escape:
+				case ::keyboard::keys::copy:
+				case ::keyboard::keys::paste:
+				case ::keyboard::keys::again:
+				case ::keyboard::keys::insert:
+				case ::keyboard::keys::stop:
+				case ::keyboard::keys::props:
+				case ::keyboard::keys::special:
+					return true;
+				default:
+					return false;
+			}
 		}
-		return static_cast<KeyUsage>(eeprom_read_byte(reinterpret_cast<uint8_t*>(keyboard::keymap_eeprom + c)));
 	}
+#endif
 
 	void keyhandler::check_config() {
-		auto version = eeprom_read_byte(&keyboard::keymap_eeprom_version);
+		auto version = eeprom_queue::read(&keyboard::keymap_eeprom_version);
 		if (version != keyboard::keymap_version) {
 			clear_config();
+		} else {
+			m_keymap.load();
+#if KEYBOARD_MACROS
+			m_macros.load();
+#endif
 		}
 	}
 
-	void keyhandler::clear_config() {
-		eeprom_update_byte(&keyboard::keymap_eeprom_version, ~keyboard::keymap_version);
-		for (uint8_t i = 0; i < DIM(keyboard::keymap_eeprom); i++) {
-			uint8_t key = pgm_read_byte_near(keymap_flash + i);
-			eeprom_update_byte(reinterpret_cast<uint8_t*>(keyboard::keymap_eeprom + i), key);
+	bool keyhandler::clear_config() {
+		// Dropping all overrides and macros is a byte write each
+#if KEYBOARD_MACROS
+		m_lastMacro = 0;
+		if (!m_macros.reset()) {
+			return false;
 		}
-		eeprom_update_byte(&keyboard::keymap_eeprom_version, keyboard::keymap_version);
-		eeprom_update_byte(&macro1_size, 0);
-		eeprom_update_byte(&macro2_size, 0);
-		eeprom_update_byte(&macro3_size, 0);
-		eeprom_update_byte(&macro4_size, 0);
+#endif
+		return m_keymap.reset() &&
+			eeprom_queue::write(&keyboard::keymap_eeprom_version, keyboard::keymap_version);
+	}
+
+	void keyhandler::save_warm() {
+		auto& state = warm::state;
+		state.led_state = m_ledState;
+		state.protocol = m_protocol;
+		state.layout = m_keymap.layout();
+#if KEYBOARD_MACROS
+		state.macro_speed = as_byte(m_macroSpeed);
+		state.last_macro = m_lastMacro;
+#else
+		state.macro_speed = 0;
+		state.last_macro = 0;
+#endif
+		state.powered = m_mode != mode::off;
+		warm::seal();
+	}
+
+	void keyhandler::restore_warm() {
+		// A copy, everything below saves into warm::state again
+		auto const state = warm::state;
+		m_ledState = state.led_state;
+		set_protocol(state.protocol);
+		if (state.layout) {
+			m_keymap.select_layout(state.layout);
+		}
+#if KEYBOARD_MACROS
+		m_lastMacro = state.last_macro;
+		m_macroSpeed = static_cast<macro_speed>(state.macro_speed & 0x03);
+#endif
+		if (state.powered) {
+			// The reset tri-stated PORTB0 and cut the keyboard supply, so
+			// it runs its self-test again. The host granted the power
+			// before, so switch it back on without waiting for the
+			// configuration. reset_ok then restores the LEDs and clicks.
+			enable();
+		}
+		save_warm();
+	}
+
+	void keyhandler::write_started(bool ok, uint8_t beep_ms) {
+		if (ok) {
+			m_writeBeep = beep_ms;
+		} else {
+			beep_error();
+		}
+	}
+
+	void keyhandler::poll_write() {
+		if (m_writeBeep == 0 || eeprom_queue::busy()) {
+			return;
+		}
+		if (eeprom_queue::failed()) {
+			beep_error();
+		} else {
+			beep(m_writeBeep);
+		}
+		m_writeBeep = 0;
 	}
 
 	void keyhandler::poll_event() {
-		if (!uart::poll()) {
+#if KEYBOARD_MACROS
+		m_macros.poll();
+#endif
+		poll_write();
+
+		if (!m_commands.full()) {
+			auto cmd = m_feedback.poll(timer::millis());
+			if (cmd != ::keyboard::command::none) {
+				command(cmd);
+			}
+		}
+		m_commands.pump();
+
+		poll_link();
+		poll_macro();
+
+		if (!coalesce_reports) {
+			if (uart::poll()) {
+				handle_byte(uart::recv());
+			}
+			return;
+		}
+
+		// Drain the whole backlog, then send what changed once per frame
+		while (uart::poll()) {
+			handle_byte(uart::recv());
+		}
+		if (m_dirtyReports && usbSofCount != m_lastSof) {
+			m_lastSof = usbSofCount;
+			commit_reports();
+		}
+	}
+
+	void keyhandler::poll_link() {
+		if (m_mode == mode::off) {
+			return;
+		}
+		if (uart::errors()) {
+			// Garbled line, start over from a clean self-test. Errors
+			// during the self-test do not reset again, the probe repeats
+			// the reset once the line is quiet.
+			if (m_mode != mode::reset) {
+				keyboard_lost();
+				command(::keyboard::command::reset);
+			}
 			return;
 		}
-		uint8_t c = uart::recv();
+		switch (m_link.poll(timer::millis())) {
+			case link_monitor::action::none:
+				break;
+			case link_monitor::action::probe:
+				// A keyboard that is not up yet is asked to reset
+				if (m_mode == mode::reset || m_mode == mode::error) {
+					command(::keyboard::command::reset);
+				} else {
+					command(::keyboard::command::layout);
+				}
+				break;
+			case link_monitor::action::lost:
+				keyboard_lost();
+				break;
+		}
+	}
+
+	void keyhandler::keyboard_lost() {
+		if (m_mode == mode::off || m_mode == mode::reset) {
+			return;
+		}
+		// Keys held on the keyboard will never see their break
+		if (macro_playing()) {
+			stop_macro();
+		}
+		clear_keys();
+		m_keystate = keystate::clear;
+		report_changed(report_type::key);
+#if KEYBOARD_MEDIA_KEYS
+		media_report.keyMask = 0;
+		system_report.keyMask = 0;
+		report_changed(report_type::media);
+		report_changed(report_type::system);
+#endif
+
+		// Recording carries on after the reset, other modes end
+		m_resumeMode = (m_mode == mode::macro_record) ? mode::macro_record : mode::normal;
+		m_click = m_mode == mode::macro_record;
+		m_mode = mode::reset;
+		m_decoder.clear();
+	}
+
+	void keyhandler::report_changed(report_type type) {
+		if (type == report_type::none) {
+			return;
+		}
+		if (coalesce_reports) {
+			m_dirtyReports |= _BV(as_byte(type));
+		} else {
+			send_report_intr(type);
+		}
+	}
+
+	void keyhandler::commit_reports() {
+		for (uint8_t type = 0; m_dirtyReports; type++) {
+			if (m_dirtyReports & _BV(type)) {
+				send_report_intr(static_cast<report_type>(type));
+				m_dirtyReports &= ~_BV(type);
+			}
+		}
+		m_dirtyBreak = 0;
+	}
+
+	void keyhandler::handle_byte(uint8_t c) {
+		m_link.received(timer::millis());
+
+		auto event = m_decoder.decode(c);
+		switch (event.type) {
+			case sun_event::kind::none:
+				return;
+			case sun_event::kind::make:
+				boot::mark(boot::stage::first_key);
+				// Neither may a make fold into the break of the same key
+				if (m_dirtyReports && (m_dirtyBreak == event.value || m_dirtyBreak == dirty_break_all)) {
+					commit_reports();
+				}
+				handle_key(event.value);
+				return;
+			case sun_event::kind::brk:
+			case sun_event::kind::all_released:
+				// A break must never be folded into the make it undoes, so
+				// send pending changes before applying any release
+				if (m_dirtyReports) {
+					commit_reports();
+				}
+				if (event.type == sun_event::kind::brk) {
+					handle_key(event.value | 0x80);
+					m_dirtyBreak = event.value;
+				} else {
+					handle_key(response::idle);
+					m_dirtyBreak = dirty_break_all;
+				}
+				return;
+			case sun_event::kind::reset:
+				keyboard_lost();
+				return;
+			case sun_event::kind::reset_ok:
+				if (m_mode == mode::reset) {
+					boot::mark(boot::stage::keyboard_ready);
+					// Restore what the self-test cleared. The layout
+					// answer selects the keymap.
+					reset_led();
+					command(::keyboard::command::layout);
+					if (m_click) {
+						command(::keyboard::command::click_on);
+					}
+					m_mode = m_resumeMode;
+					m_resumeMode = mode::normal;
+				}
+				return;
+			case sun_event::kind::reset_fail:
+				if (m_mode == mode::reset) {
+					fill_keys(KeyUsage::ERROR_POST_FAIL);
+					report_changed(report_type::key);
+					m_mode = mode::error;
+				}
+				return;
+			case sun_event::kind::layout:
+				m_keymap.select_layout(event.value);
+				save_warm();
+				return;
+		}
+	}
 
-		// Handle keyboard response codes
-		if (c == response::layout) {
-			m_mode = mode::layout;
-		} else if (c == response::reset) {
-			m_mode = mode::reset;
+	void keyhandler::handle_key(uint8_t c) {
+		// Special cancels a running macro instead of entering Fn
+		if (c == ::keyboard::keys::special && macro_playing() && m_mode == mode::normal) {
+			stop_macro();
 			return;
 		}
 
@@ -114,42 +353,34 @@ namespace keyboard {
 				// Uhhh, what?
 				return;
 			case mode::reset:
-				if (c == response::reset_ok) {
-					command(::keyboard::command::led_status, m_ledState);
-					m_mode = mode::normal;
-				} else if (c == response::reset_fail1) {
-					for (auto& key: key_report.keys) {
-						key = KeyUsage::ERROR_POST_FAIL;
-					}
-				} else if (c == response::reset_fail2) {
-					m_mode = mode::error;
-				}
+				// Waiting for the self-test
 				return;
 			case mode::normal:
 			case mode::macro_record:
 				// Handle keyboard response codes
 				if (c == response::idle) {
 					if (m_keystate != keystate::clear) {
-						key_report.modMask = 0;
-						for (auto& key: key_report.keys) {
-							key = KeyUsage::RESERVED;
-						}
+						clear_keys();
 						if (m_keystate == keystate::rollover) {
 							command(::keyboard::command::click_off);
 						}
 						m_keystate = keystate::clear;
-						send_report_intr(report_type::key);
+						report_changed(report_type::key);
 						return;
 					}
 					return;
 				}
 
 				if (c == ::keyboard::keys::special) {
+#if KEYBOARD_MACROS
 					if (m_mode == mode::macro_record) {
-						command(::keyboard::command::click_off);
-						reset_led();
-						m_mode = mode::normal;
-					} else if (m_keystate == keystate::clear) {
+						if (!end_recording()) {
+							beep_error();
+						}
+						return;
+					}
+#endif
+					if (m_keystate == keystate::clear) {
 						m_mode = mode::fn;
 						set_led(::keyboard::led::compose);
 					}
@@ -157,13 +388,15 @@ namespace keyboard {
 					return;
 				}
 
-				send_report_intr(handle_keycode(c));
+				report_changed(handle_keycode(c));
 				return;
 			case mode::fn:
 				if (c == response::idle) {
 					reset_led();
 					m_mode = mode::normal;
 				} else {
+					// Fn actions send directly, keep them behind earlier changes
+					commit_reports();
 					send_report_intr(handle_keycode_fn(c));
 				}
 				return;
@@ -175,6 +408,7 @@ namespace keyboard {
 					handle_morsecode(c);
 				}
 				return;
+#if KEYBOARD_KEY_SWAP
 			case mode::keyswap1:
 				if (c == ::keyboard::keys::special) {
 					reset_led();
@@ -189,149 +423,138 @@ namespace keyboard {
 					reset_led();
 					m_mode = mode::normal;
 					if (c != ::keyboard::keys::special) {
-						// Read original code from flash
-						auto keyUsage = static_cast<KeyUsage>(pgm_read_word_near(keymap_flash + m_curOverride));
-						eeprom_update_byte(reinterpret_cast<uint8_t*>(keymap_eeprom + c), static_cast<uint8_t>(keyUsage));
-						beep<50>();
+						// Read original code from the layout table
+						auto keyUsage = m_keymap.base(m_curOverride);
+						// Fails when the override list is full
+						write_started(m_keymap.set(c, keyUsage), 50);
 					}
 				}
 				return;
+#endif
+#if KEYBOARD_MACROS
 			case mode::macro_save:
 				if (c < response::idle) {
-					bool ok = false;
-					switch (c) {
-						case ::keyboard::keys::n1:
-						case ::keyboard::keys::f9:
-							if (m_macroSize <= DIM(macro1)) {
-								eeprom_update_block(m_macroBuffer, macro1, m_macroSize);
-								eeprom_update_byte(&macro1_size, m_macroSize);
-								ok = true;
-							}
-							break;
-						case ::keyboard::keys::n2:
-						case ::keyboard::keys::f10:
-							if (m_macroSize <= DIM(macro2)) {
-								eeprom_update_block(m_macroBuffer, macro2, m_macroSize);
-								eeprom_update_byte(&macro2_size, m_macroSize);
-								ok = true;
-							}
-							break;
-						case ::keyboard::keys::n3:
-						case ::keyboard::keys::f11:
-							if (m_macroSize <= DIM(macro3)) {
-								eeprom_update_block(m_macroBuffer, macro3, m_macroSize);
-								eeprom_update_byte(&macro3_size, m_macroSize);
-								ok = true;
-							}
-							break;
-						case ::keyboard::keys::n4:
-						case ::keyboard::keys::f12:
-							if (m_macroSize <= DIM(macro4)) {
-								eeprom_update_block(m_macroBuffer, macro4, m_macroSize);
-								eeprom_update_byte(&macro4_size, m_macroSize);
-								ok = true;
-							}
-							break;
-						default:
-							break;
-					}
-
-					if (ok) {
-						beep<50>();
-					} else {
-						beep<50>();
-						_delay_ms(50);
-						beep<50>();
+					if (c != ::keyboard::keys::special) {
+						if (fn_bound(c)) {
+							beep_error();
+						} else {
+							write_started(m_macros.save(c), 50);
+							m_lastMacro = c;
+							save_warm();
+						}
 					}
 					reset_led();
 					m_mode = mode::normal;
 				}
 				return;
+#endif
 			case mode::error:
-				return;
-			case mode::layout:
-				// c is layout
-				m_mode = mode::normal;
+			default:
 				return;
 		}
 	}
 
 	report_type keyhandler::press(KeyUsage key) {
-		if (key >= KeyUsage::LEFTCTRL && key <= KeyUsage::RIGHTGUI)
-		{
-			auto bit = as_byte(key) - as_byte(KeyUsage::LEFTCTRL);
-			key_report.modMask |= 1 << bit;
-			m_keystate = keystate::in_use;
-			return report_type::key;
-		} else if (key >= KeyUsage::MUTE && key <= KeyUsage::VOLUME_DOWN) {
-			auto bit = as_byte(key) - as_byte(KeyUsage::MUTE);
-			media_report.keyMask |= 1 << bit;
-			return report_type::media;
-		} else if (key == KeyUsage::POWER) {
-			// Since sleep & power are the same key (but shifted)
-			// simply overwrite value, do not OR
-			if (key_report.modMask & 0b00100010) {
-				// power
-				system_report.keyMask = 0b01;
-			} else {
-				// sleep
-				system_report.keyMask = 0b10;
-			}
-			/*
-			auto bit = as_byte(key) - as_byte(KeyUsage::POWER);
-			system_report.keyMask |= 1 << bit;
-			 */
-			return report_type::system;
-		}
-		if (key >= KeyUsage::RESERVED && key <= KeyUsage::VOLUME_DOWN &&
-		  m_keystate != keystate::rollover) {
-			size_t i;
-			for (auto& rkey: key_report.keys) {
-				if (rkey == KeyUsage::RESERVED) {
-					rkey = key;
-					break;
-				}
-			}
-			if (i == key_report.keys.size()) {
-				m_keystate = keystate::rollover;
-				for (auto& rkey: key_report.keys) {
-					rkey = KeyUsage::ERROR_ROLLOVER;
+		uint8_t bit;
+		switch (usage_table::route(key, bit)) {
+			case usage_route::none:
+				return report_type::none;
+			case usage_route::modifier:
+				modifiers() |= 1 << bit;
+				m_keystate = keystate::in_use;
+				return report_type::key;
+#if KEYBOARD_MEDIA_KEYS
+			case usage_route::media:
+				media_report.keyMask |= 1 << bit;
+				return report_type::media;
+			case usage_route::power:
+				// Since sleep & power are the same key (but shifted)
+				// simply overwrite value, do not OR
+				if (modifiers() & 0b00100010) {
+					// power
+					system_report.keyMask = 0b01;
+				} else {
+					// sleep
+					system_report.keyMask = 0b10;
 				}
-				command(::keyboard::command::click_on);
-			} else {
+				return report_type::system;
+#endif
+			case usage_route::key:
+				break;
+			default:
+				return report_type::none;
+		}
+#if KEYBOARD_NKRO
+		if (!nkro_report.test(key)) {
+			nkro_report.set(key);
+			m_nkroKeys++;
+		}
+		m_keystate = keystate::in_use;
+#else
+		if (m_keystate == keystate::rollover) {
+			return report_type::none;
+		}
+		for (auto& rkey: key_report.keys) {
+			if (rkey == KeyUsage::RESERVED) {
+				rkey = key;
 				m_keystate = keystate::in_use;
+				return report_type::key;
 			}
-			return report_type::key;
 		}
-		return report_type::none;
+		m_keystate = keystate::rollover;
+		for (auto& rkey: key_report.keys) {
+			rkey = KeyUsage::ERROR_ROLLOVER;
+		}
+		command(::keyboard::command::click_on);
+#endif
+		return report_type::key;
 	}
 
 	report_type keyhandler::release(KeyUsage key) {
-		if (key >= KeyUsage::LEFTCTRL && key <= KeyUsage::RIGHTGUI) {
-			auto bit = as_byte(key) - as_byte(KeyUsage::LEFTCTRL);
-			key_report.modMask &= ~(1 << bit);
-		} else if (key >= KeyUsage::MUTE && key <= KeyUsage::VOLUME_DOWN) {
-			auto bit = as_byte(key) - as_byte(KeyUsage::MUTE);
-			media_report.keyMask &= ~(1 << bit);
-			return report_type::media;
-		} else if (key == KeyUsage::POWER) {
-			system_report.keyMask = 0;
-			/* Since both sleep & power are the same key, release both since
-			 * shift may be released beforehand
-			auto bit = as_byte(key) - as_byte(KeyUsage::POWER);
-			system_report.keyMask &= ~(1 << bit);
-			 */
-			return report_type::system;
-		} else if (key >= KeyUsage::RESERVED && key <= KeyUsage::VOLUME_DOWN &&
-		  m_keystate != keystate::rollover) {
-			for (auto& rkey: key_report.keys) {
-				if (rkey == key) {
-					rkey = KeyUsage::RESERVED;
-					break;
+		uint8_t bit;
+		switch (usage_table::route(key, bit)) {
+			case usage_route::none:
+				// Still updates the key state below
+				break;
+			case usage_route::modifier:
+				modifiers() &= ~(1 << bit);
+				break;
+#if KEYBOARD_MEDIA_KEYS
+			case usage_route::media:
+				media_report.keyMask &= ~(1 << bit);
+				return report_type::media;
+			case usage_route::power:
+				// Since both sleep & power are the same key, release both
+				// since shift may be released beforehand
+				system_report.keyMask = 0;
+				return report_type::system;
+#endif
+			default:
+				break;
+			case usage_route::key:
+#if KEYBOARD_NKRO
+				if (nkro_report.test(key)) {
+					nkro_report.clear(key);
+					m_nkroKeys--;
 				}
-			}
+#else
+				if (m_keystate != keystate::rollover) {
+					for (auto& rkey: key_report.keys) {
+						if (rkey == key) {
+							rkey = KeyUsage::RESERVED;
+							break;
+						}
+					}
+				}
+#endif
+				break;
 		}
 
+#if KEYBOARD_NKRO
+		if (m_keystate != keystate::clear && m_nkroKeys == 0 && nkro_report.modMask == 0) {
+			m_keystate = keystate::clear;
+		}
+#else
 		if (m_keystate != keystate::clear) {
 			bool clear = true;
 			for (auto const& rkey: key_report.keys) {
@@ -344,15 +567,67 @@ namespace keyboard {
 				m_keystate = keystate::clear;
 			}
 		}
+#endif
 
 		return report_type::key;
 	}
 
+	void keyhandler::clear_keys() {
+#if KEYBOARD_NKRO
+		memset(nkro_report.keyMask, 0, sizeof(nkro_report.keyMask));
+		nkro_report.modMask = 0;
+		m_nkroKeys = 0;
+#else
+		key_report.modMask = 0;
+		for (auto& key: key_report.keys) {
+			key = KeyUsage::RESERVED;
+		}
+#endif
+	}
+
+	void keyhandler::fill_keys(KeyUsage key) {
+#if KEYBOARD_NKRO
+		if (!nkro_report.test(key)) {
+			nkro_report.set(key);
+			m_nkroKeys++;
+		}
+#else
+		for (auto& rkey: key_report.keys) {
+			rkey = key;
+		}
+#endif
+	}
+
+	void keyhandler::update_boot_report() {
+#if KEYBOARD_NKRO
+		// BIOS only understands six keys, report rollover beyond that
+		boot_report.modMask = nkro_report.modMask;
+		boot_report.keys = {{KeyUsage::RESERVED}};
+		uint8_t n = 0;
+		for (uint8_t usage = 0; usage < nkro_usage_count && n <= boot_report.keys.size(); usage++) {
+			auto key = static_cast<KeyUsage>(usage);
+			if (!nkro_report.test(key)) {
+				continue;
+			}
+			if (n == boot_report.keys.size()) {
+				for (auto& rkey: boot_report.keys) {
+					rkey = KeyUsage::ERROR_ROLLOVER;
+				}
+				break;
+			}
+			boot_report.keys[n++] = key;
+		}
+#else
+		boot_report.modMask = key_report.modMask;
+		boot_report.keys = key_report.keys;
+#endif
+	}
+
 	report_type keyhandler::handle_keycode(uint8_t c) {
 		uint8_t break_bit = (c & static_cast<uint8_t>(0x80));
 		c &= 0x7F;
 
-		auto key = read_keymap(c);
+		auto key = m_keymap.lookup(c);
 		if (key == KeyUsage::RESERVED) {
 			return report_type::none;
 		}
@@ -364,16 +639,18 @@ namespace keyboard {
 			type = release(key);
 		}
 
+#if KEYBOARD_MACROS
 		if (type == report_type::key && m_mode == mode::macro_record) {
-			m_macroBuffer[m_macroSize] = (c | break_bit);
-			m_macroSize++;
-			if (m_macroSize == DIM(m_macroBuffer)) {
-				command(::keyboard::command::click_off);
-				reset_led();
-				m_mode = mode::normal;
-				beep<150>();
+			if (!m_macros.record(c | break_bit, timer::millis())) {
+				// Full, keep what fits
+				if (end_recording()) {
+					beep(150);
+				} else {
+					beep_error();
+				}
 			}
 		}
+#endif
 
 		return type;
 	}
@@ -383,41 +660,46 @@ namespace keyboard {
 			//TODO: check if shifted key, return true if so
 			return report_type::none;
 		}
-		if (c == ::keyboard::keys::f1) {
+		if (features::morse && c == ::keyboard::keys::f1) {
 			m_mode = mode::morse;
-			beep<150>();
-		} else if (c == ::keyboard::keys::cut) {
+			beep(150);
+		} else if (features::key_swap && c == ::keyboard::keys::cut) {
 			m_mode = mode::keyswap1;
-			beep<150>();
+			beep(150);
 		} else if (c == ::keyboard::keys::escape) {
-			clear_config();
-			beep<150>();
+			write_started(clear_config(), 150);
+		} else if (c == ::keyboard::keys::stop) {
+			print_stack();
+#if KEYBOARD_MACROS
+		} else if (c == ::keyboard::keys::props) {
+			// Cycle playback speed, one beep per step from original timing
+			auto speed = (as_byte(m_macroSpeed) + 1) & 0x03;
+			m_macroSpeed = static_cast<macro_speed>(speed);
+			save_warm();
+			beep(50);
+			while (speed--) {
+				m_feedback.pause(50);
+				m_feedback.tone(50);
+			}
+		} else if (macro_busy() && (c == ::keyboard::keys::copy || c == ::keyboard::keys::paste || !fn_bound(c))) {
+			// Macro is still being played or saved
+			return report_type::none;
 		} else if (c == ::keyboard::keys::copy) {
-			m_mode = mode::macro_record;
-			m_macroSize = 0;
-			command(::keyboard::command::click_on);
+			if (m_macros.begin_record()) {
+				m_mode = mode::macro_record;
+				m_lastMacro = 0;
+				save_warm();
+				command(::keyboard::command::click_on);
+			} else {
+				beep_error();
+			}
 		} else if (c == ::keyboard::keys::paste) {
 			m_mode = mode::macro_save;
-		} else if (c == ::keyboard::keys::n1 || c == ::keyboard::keys::f9) {
-			m_macroSize = eeprom_read_byte(&macro1_size);
-			eeprom_read_block(m_macroBuffer, macro1, m_macroSize);
-			return play_macro();
-		} else if (c == ::keyboard::keys::n2 || c == ::keyboard::keys::f10) {
-			m_macroSize = eeprom_read_byte(&macro2_size);
-			eeprom_read_block(m_macroBuffer, macro2, m_macroSize);
-			return play_macro();
-		} else if (c == ::keyboard::keys::n3 || c == ::keyboard::keys::f11) {
-			m_macroSize = eeprom_read_byte(&macro3_size);
-			eeprom_read_block(m_macroBuffer, macro3, m_macroSize);
-			return play_macro();
-		} else if (c == ::keyboard::keys::n4 || c == ::keyboard::keys::f12) {
-			m_macroSize = eeprom_read_byte(&macro4_size);
-			eeprom_read_block(m_macroBuffer, macro4, m_macroSize);
-			return play_macro();
 		} else if (c == ::keyboard::keys::again || c == ::keyboard::keys::insert) {
-			return play_macro();
-		} else if (c == ::keyboard::keys::stop) {
-			print_stack();
+			return play_macro(m_lastMacro);
+		} else if (!fn_bound(c)) {
+			return play_macro(c);
+#endif
 		}
 
 		return report_type::none;
@@ -425,70 +707,158 @@ namespace keyboard {
 
 	void keyhandler::print_stack() {
 		auto count = StackCount();
+		uint16_t idle, busy;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			idle = timer::idle_ticks;
+			busy = timer::busy_ticks;
+			timer::idle_ticks = 0;
+			timer::busy_ticks = 0;
+		}
 
-		key_report.modMask = count;
-		send_report_intr(report_type::key);
-		key_report.modMask = count >> 8;
+		// Each value goes out as modifier bits, low byte first
+		const uint8_t values[] = {
+			static_cast<uint8_t>(count), static_cast<uint8_t>(count >> 8),
+			SPL, SPH,
+			static_cast<uint8_t>(idle), static_cast<uint8_t>(idle >> 8),
+			static_cast<uint8_t>(busy), static_cast<uint8_t>(busy >> 8),
+		};
+		bool ok = true;
+		for (auto value: values) {
+			ok = ok && send_modifiers(value);
+		}
+		// Boot stage time stamps follow
+		for (auto stamp: boot::stamps) {
+			ok = ok && send_modifiers(stamp) && send_modifiers(stamp >> 8);
+		}
+		// Release the modifiers even when the dump was cut short by a
+		// suspend, the report then goes out after the resume
+		wait_reports();
+		modifiers() = 0;
 		send_report_intr(report_type::key);
+	}
 
-		key_report.modMask = SPL;
-		send_report_intr(report_type::key);
-		key_report.modMask = SPH;
+	bool keyhandler::send_modifiers(uint8_t value) {
+		if (!wait_reports()) {
+			return false;
+		}
+		modifiers() = value;
 		send_report_intr(report_type::key);
+		return true;
+	}
 
-		key_report.modMask = 0;
-		send_report_intr(report_type::key);
+#if KEYBOARD_MACROS
+	report_type keyhandler::play_macro(uint8_t key) {
+		// Steps are taken from poll_macro
+		if (macro_playing()) {
+			stop_macro();
+		}
+		uint8_t length = 0;
+		auto data = key ? m_macros.find(key, length) : m_macros.recorded(length);
+		if (data && length) {
+			m_macroReader.open(data, length);
+			m_macroPlaying = true;
+			m_macroHasNext = false;
+			m_macroFrame = usbSofCount;
+			m_lastMacro = key;
+			save_warm();
+		}
+		return report_type::none;
 	}
 
-	report_type keyhandler::play_macro() {
-		// Playback of macro buffer
-		for(uint8_t i = 0; i < m_macroSize; i++) {
-			handle_keycode(m_macroBuffer[i]);
-			send_report_intr(report_type::key);
+	void keyhandler::poll_macro() {
+		if (!macro_playing()) {
+			return;
 		}
-		// Send all keys up
-		if (m_keystate != keystate::clear) {
-			key_report.modMask = 0;
-			for (uint8_t i = 0; i < sizeof(key_report.keys); i++) {
-				key_report.keys[i] = KeyUsage::RESERVED;
+		if (static_cast<uint8_t>(usbSofCount - m_macroFrame) < macro_interval) {
+			return;
+		}
+		// Only step once everything before it went out, so each step
+		// gets its own frame
+		if (reports_queued()) {
+			return;
+		}
+		m_macroFrame = usbSofCount;
+
+		auto now = timer::millis();
+		if (!m_macroHasNext) {
+			uint16_t delay;
+			if (!m_macroReader.next(m_macroNext, delay)) {
+				stop_macro();
+				return;
 			}
-			m_keystate = keystate::clear;
-			return report_type::key;
+			m_macroHasNext = true;
+			if (m_macroSpeed == macro_speed::max) {
+				delay = 0;
+			} else {
+				delay >>= as_byte(m_macroSpeed);
+			}
+			m_macroDue = now + delay;
+		}
+		if (!timer::reached(now, m_macroDue)) {
+			return;
 		}
+		m_macroHasNext = false;
 
-		return report_type::none;
+		uint8_t c = m_macroNext;
+		if (!macro_hold(c)) {
+			// More keys down than it can track, skip the press
+			return;
+		}
+		send_report_intr(handle_keycode(c));
 	}
 
+	bool keyhandler::macro_hold(uint8_t c) {
+		// Makes take a free slot, breaks free theirs
+		uint8_t find = (c & 0x80) ? (c & 0x7F) : 0;
+		for (auto& held: m_macroHeld) {
+			if (held == find) {
+				held = (c & 0x80) ? 0 : c;
+				return true;
+			}
+		}
+		return c & 0x80;
+	}
+
+	void keyhandler::stop_macro() {
+		// Release what the macro still holds, keys held on the keyboard
+		// itself stay down
+		for (auto& held: m_macroHeld) {
+			if (held) {
+				report_changed(handle_keycode(held | 0x80));
+				held = 0;
+			}
+		}
+		m_dirtyBreak = dirty_break_all;
+		m_macroPlaying = false;
+	}
+
+	bool keyhandler::end_recording() {
+		command(::keyboard::command::click_off);
+		reset_led();
+		m_mode = mode::normal;
+		return m_macros.end_record();
+	}
+#endif
+
 	void keyhandler::handle_morsecode(uint8_t c) {
+#if KEYBOARD_MORSE
 		if ((c & 0x80) != 0) {
 			return;
 		}
 		c &= 0x7F;
 
 		// USB keycodes are nicely arranged
-		auto key = static_cast<KeyUsage>(pgm_read_byte_near(keymap_flash + c));
+		auto key = m_keymap.base(c);
 		if (key >= KeyUsage::A && key <= KeyUsage::N0) {
 			c = as_byte(key) - as_byte(KeyUsage::A);
 		} else {
 			return;
 		}
-		auto code = static_cast<uint8_t>(pgm_read_byte_near(morse::codes + c));
-		uint8_t len = code >> 5;
-		code <<= 3;
-		while(len > 0) {
-			if (code & 0x80) {
-				// long
-				beep<150>();
-			} else {
-				// short
-				beep<75>();
-			}
-			_delay_ms(75);
-
-			code <<= 1;
-			len--;
-		}
-		_delay_ms(150);
+		// Played back from poll_event, so typing is never held up
+		m_feedback.morse(pgm_read_byte_near(morse::codes + c));
+#else
+		(void)c;
+#endif
 	}
 
 	void keyhandler::set_led_report(unsigned char data) {
@@ -509,33 +879,115 @@ namespace keyboard {
 		set_ledstate(ledStatus);
 	}
 
-	void keyhandler::send_report_intr(report_type type) {
-		if (type == report_type::none) {
-			return;
-		}
-
-		while(!usbInterruptIsReady()) {
-			usbPoll();
-		}
-
+	bool keyhandler::queue_report(report_type type) {
 		if (m_protocol == protocol_boot && (type == report_type::boot || type == report_type::key)) {
 			update_boot_report();
-			usbSetInterrupt(const_cast<unsigned char *>(boot_report_data), sizeof(boot_report_data));
+			return m_reports.push(as_byte(report_type::boot), boot_report_data, sizeof(boot_report_data));
 		} else {
 			switch(type) {
 				default:
 				case report_type::key:
 					// Keyboard
-					usbSetInterrupt(const_cast<unsigned char *>(key_report_data), sizeof(key_report_data));
-					break;
+#if KEYBOARD_NKRO
+					return queue_chunked(nkro_report_data, sizeof(nkro_report_data));
+#else
+					return m_reports.push(as_byte(report_type::key), key_report_data, sizeof(key_report_data));
+#endif
+#if KEYBOARD_MEDIA_KEYS
 				case report_type::media:
 					// Media
-					usbSetInterrupt(const_cast<unsigned char *>(media_report_data), sizeof(media_report_data));
-					break;
+					return queue_media(report_type::media, media_report_data, sizeof(media_report_data));
 				case report_type::system:
-					usbSetInterrupt(const_cast<unsigned char *>(system_report_data), sizeof(system_report_data));
-					break;
+					return queue_media(report_type::system, system_report_data, sizeof(system_report_data));
+#endif
+			}
+		}
+	}
+
+	bool keyhandler::queue_media(report_type type, const unsigned char* data, uint8_t length) {
+#if KEYBOARD_MEDIA_ENDPOINT
+		return m_mediaReports.push(as_byte(type), data, length);
+#else
+		return m_reports.push(as_byte(type), data, length);
+#endif
+	}
+
+	bool keyhandler::queue_chunked(const unsigned char* data, uint8_t length) {
+		// Reports longer than the 8 byte packet size go out as consecutive
+		// packets, the host joins them until the short final packet. All
+		// chunks are queued at once so nothing can end up in between.
+		constexpr uint8_t packet = sizeof(m_reports.front().data);
+		if (m_reports.free() < (length + packet - 1) / packet) {
+			return false;
+		}
+		auto type = report_type::key;
+		while (length > 0) {
+			uint8_t chunk = length < packet ? length : packet;
+			m_reports.push(as_byte(type), data, chunk);
+			type = report_type::none; // Continuation
+			data += chunk;
+			length -= chunk;
+		}
+		return true;
+	}
+
+	void keyhandler::send_report_intr(report_type type) {
+		if (type == report_type::none) {
+			return;
+		}
+
+		if (!queue_report(type)) {
+			m_pendingReports |= _BV(as_byte(type));
+		}
+	}
+
+	report_type keyhandler::flush_reports() {
+		// Requeue the current state of reports that did not fit earlier
+		// Either queue may be the full one, so every type gets its turn
+		for (uint8_t type = 0; m_pendingReports && type <= as_byte(report_type::nkro); type++) {
+			if ((m_pendingReports & _BV(type)) && queue_report(static_cast<report_type>(type))) {
+				m_pendingReports &= ~_BV(type);
 			}
 		}
+
+		if (m_reports.empty() || !usbInterruptIsReady()) {
+			return report_type::none;
+		}
+
+		auto const& report = m_reports.front();
+		usbSetInterrupt(const_cast<unsigned char *>(report.data), report.length);
+		auto type = static_cast<report_type>(report.type);
+		m_reports.pop();
+		return type;
+	}
+
+#if KEYBOARD_MEDIA_ENDPOINT
+	report_type keyhandler::flush_media_reports() {
+		if (m_mediaReports.empty() || !usbInterruptIsReady3()) {
+			return report_type::none;
+		}
+
+		auto const& report = m_mediaReports.front();
+		usbSetInterrupt3(const_cast<unsigned char *>(report.data), report.length);
+		auto type = static_cast<report_type>(report.type);
+		m_mediaReports.pop();
+		return type;
+	}
+#endif
+
+	bool keyhandler::wait_reports(uint8_t slots) {
+		// Only for bursts that must not lose intermediate states
+		while (m_reports.free() < slots) {
+			// Give up once the host suspends the bus, the main loop then
+			// suspends as well
+			if (timer::sof_idle >= timer::suspend_timeout) {
+				return false;
+			}
+			// Draining takes several host polls, longer than the watchdog
+			wdt_reset();
+			usbPoll();
+			flush_reports();
+		}
+		return true;
 	}
 }
\ No newline at end of file
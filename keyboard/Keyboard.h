@@ -1,6 +1,21 @@
 #pragma once
 
+#include "boot.h"
+#include "command_queue.h"
+#include "commands.h"
+#include "eeprom_queue.h"
+#include "options.h"
+#include "feedback.h"
+#include "keymap.h"
+#include "link_monitor.h"
+#if KEYBOARD_MACROS
+#include "macro_store.h"
+#endif
+#include "sun_protocol.h"
+#include "report_queue.h"
 #include "uart.h"
+#include "usage_table.h"
+#include "warm_state.h"
 #include <usb/report.h>
 
 extern "C" {
@@ -8,7 +23,7 @@ extern "C" {
 }
 
 #include <stdint.h>
-#include <util/delay.h>
+#include <string.h>
 #include <avr/eeprom.h>
 
 namespace keyboard {
@@ -39,27 +54,6 @@ namespace keyboard {
 			return N;
 		}
 	};
-	enum class command : uint8_t {
-		// Commands to keyboard
-		reset = 0x01,
-		bell_on = 0x02,
-		bell_off = 0x03,
-		click_on = 0x0A,
-		click_off = 0x0B,
-		led_status = 0x0E,
-		layout = 0x0F,
-	};
-
-	namespace response {
-		// Responses from keyboard
-		constexpr uint8_t idle = 0x7F;
-		constexpr uint8_t layout = 0xFE; // followed by layout byte
-		constexpr uint8_t reset = 0xFF;  // followed by 0x04, then make codes or IDLE. When failed, 0x7E 0x01
-		constexpr uint8_t reset_ok = 0x04;
-		constexpr uint8_t reset_fail1 = 0x7E;
-		constexpr uint8_t reset_fail2 = 0x01;
-	};
-
 	enum class led : uint8_t {
 		numlock = 0x01,
 		compose = 0x02,
@@ -72,6 +66,7 @@ namespace keyboard {
 		key = 1,
 		media = 2,
 		system = 3,
+		nkro = 4,
 		none = 0xff
 	};
 
@@ -107,26 +102,46 @@ namespace keyboard {
 	};
 	static_assert(sizeof(system_report_t) == 2, "Invalid report size");
 
-	static constexpr uint8_t macro_large = 127;
-	static constexpr uint8_t macro_small = 63;
-	extern EEMEM uint8_t macro1[macro_large];
-	extern EEMEM uint8_t macro1_size;
-	extern EEMEM uint8_t macro2[macro_large];
-	extern EEMEM uint8_t macro2_size;
-	extern EEMEM uint8_t macro3[macro_small];
-	extern EEMEM uint8_t macro3_size;
-	extern EEMEM uint8_t macro4[macro_small];
-	extern EEMEM uint8_t macro4_size;
+	// Bitmap of every usage up to last_key_usage, one bit per key
+	static constexpr uint8_t nkro_usage_count = as_byte(last_key_usage) + 1;
+	static constexpr uint8_t nkro_key_bytes = (nkro_usage_count + 7) / 8;
+
+	struct nkro_report_t {
+		report_type report_id = report_type::nkro;
+		uint8_t modMask = 0;
+		uint8_t keyMask[nkro_key_bytes] = {0};
+
+		bool test(KeyUsage key) const {
+			return keyMask[as_byte(key) >> 3] & _BV(as_byte(key) & 0x07);
+		}
+		void set(KeyUsage key) {
+			keyMask[as_byte(key) >> 3] |= _BV(as_byte(key) & 0x07);
+		}
+		void clear(KeyUsage key) {
+			keyMask[as_byte(key) >> 3] &= ~_BV(as_byte(key) & 0x07);
+		}
+	};
+	static_assert(sizeof(nkro_report_t) == 20, "Invalid report size");
+
 
 	class keyhandler {
 		union {
 			boot_report_t boot_report;
 			unsigned char boot_report_data[sizeof(boot_report_t)];
 		};
+#if KEYBOARD_NKRO
+		union {
+			nkro_report_t nkro_report;
+			unsigned char nkro_report_data[sizeof(nkro_report_t)];
+		};
+		uint8_t m_nkroKeys; // Number of bits set in nkro_report.keyMask
+#else
 		union {
 			key_report_t key_report;
 			unsigned char key_report_data[sizeof(key_report_t)];
 		};
+#endif
+#if KEYBOARD_MEDIA_KEYS
 		union {
 			media_report_t media_report;
 			unsigned char media_report_data[sizeof(media_report_t)];
@@ -135,13 +150,14 @@ namespace keyboard {
 			system_report_t system_report;
 			unsigned char system_report_data[sizeof(system_report_t)];
 		};
+#endif
+		// Modes of disabled features stay, they are just never entered
 		enum class mode : uint8_t {
 			off,
 			reset,
 			normal,
 			fn,
 			error,
-			layout,
 			keyswap1,
 			keyswap2,
 			macro_record,
@@ -150,6 +166,13 @@ namespace keyboard {
 		};
 
 		mode m_mode;
+		sun_decoder m_decoder;
+
+		// Keyboard connection. While the keyboard is lost or resetting
+		// m_mode is reset, m_resumeMode is entered once it is back.
+		link_monitor m_link;
+		mode m_resumeMode;
+		bool m_click; // Click state to restore after a reset
 		enum class keystate : uint8_t {
 			clear,
 			in_use,
@@ -157,72 +180,218 @@ namespace keyboard {
 		};
 		keystate m_keystate;
 
-		union {
-			uint8_t m_curOverride;
-			uint8_t m_macroSize;
+#if KEYBOARD_KEY_SWAP
+		uint8_t m_curOverride;
+#endif
+
+#if KEYBOARD_MACROS
+		macro_store m_macros;
+		uint8_t m_lastMacro; // Key of the macro Again replays, 0 for the recording
+
+		// Macro playback runs next to the current mode, one step every
+		// macro_interval frames at most. Live keys keep working in between.
+		static constexpr uint8_t macro_interval = KEYBOARD_MACRO_INTERVAL;
+		enum class macro_speed : uint8_t {
+			original,
+			double_speed,
+			quad_speed,
+			max, // Recorded pauses are skipped
 		};
-		uint8_t m_macroBuffer[macro_large];
+		macro_speed m_macroSpeed;
+		macro_reader m_macroReader;
+		bool m_macroPlaying;
+		bool m_macroHasNext; // m_macroNext is read ahead, due at m_macroDue
+		uint8_t m_macroNext;
+		uint16_t m_macroDue;
+		uint8_t m_macroFrame;
+		uint8_t m_macroHeld[6]; // Scancodes pressed by the macro, 0 if free
+#endif
 		uint8_t m_ledState;
 		uint8_t m_protocol;
 
+		keymap_cache m_keymap;
+		feedback m_feedback;
+		command_queue m_commands;
+
+		// Beep once the queued EEPROM writes complete, 0 if none pending
+		uint8_t m_writeBeep;
+
+		// Reports waiting for the interrupt endpoint. When the queue
+		// overflows the report type is flagged in m_pendingReports and
+		// its latest state is queued as soon as there is room again, so
+		// intermediate states may be lost but the final state never is.
+		report_queue<4> m_reports;
+		uint8_t m_pendingReports;
+
+		// Queue slots one keyboard report takes, NKRO goes out in chunks
+#if KEYBOARD_NKRO
+		static constexpr uint8_t packet_size = sizeof(decltype(m_reports)::entry::data);
+		static constexpr uint8_t key_report_slots = (sizeof(nkro_report_t) + packet_size - 1) / packet_size;
+#else
+		static constexpr uint8_t key_report_slots = 1;
+#endif
+		static_assert(key_report_slots <= decltype(m_reports)::depth, "Keyboard report does not fit the queue");
+#if KEYBOARD_MEDIA_ENDPOINT
+		// Consumer and system reports have their own endpoint, so they
+		// never wait behind keyboard reports or the other way around
+		static_assert(sizeof(system_report_t) <= sizeof(media_report_t), "System report does not fit the media queue");
+		report_queue<2, sizeof(media_report_t)> m_mediaReports;
+#endif
+
+		// Reports changed since the last frame, only used when coalescing
+		static constexpr bool coalesce_reports = features::coalesce_reports;
+		uint8_t m_dirtyReports;
+		uint8_t m_lastSof;
+		// Key released in the uncommitted reports, so pressing it again
+		// must commit first. 0 if none, dirty_break_all after idle.
+		static constexpr uint8_t dirty_break_all = 0xFF;
+		uint8_t m_dirtyBreak;
+
 		void check_config();
-		void clear_config();
+		bool clear_config();
+
+		void save_warm();
+		void restore_warm();
+
+		void write_started(bool ok, uint8_t beep_ms);
+		void poll_write();
 		report_type handle_keycode(uint8_t key);
 		report_type handle_keycode_fn(uint8_t key);
 		void handle_morsecode(uint8_t key);
+#if KEYBOARD_MACROS
+		bool macro_hold(uint8_t c);
+#endif
+
+#if KEYBOARD_MACROS
+		report_type play_macro(uint8_t key);
+		void poll_macro();
+		void stop_macro();
+		bool macro_playing() const {
+			return m_macroPlaying;
+		}
+		bool macro_busy() const {
+			return macro_playing() || m_macros.busy() || (eeprom_queue::busy() && m_writeBeep != 0);
+		}
+		bool end_recording();
+#else
+		void poll_macro() {}
+		void stop_macro() {}
+		bool macro_playing() const {
+			return false;
+		}
+#endif
+
+		bool queue_report(report_type type);
+		bool queue_chunked(const unsigned char* data, uint8_t length);
+		bool queue_media(report_type type, const unsigned char* data, uint8_t length);
+		bool wait_reports(uint8_t slots = key_report_slots);
+		bool send_modifiers(uint8_t value);
 
-		report_type play_macro();
+		void handle_byte(uint8_t c);
+		void handle_key(uint8_t c);
+		void poll_link();
+		void keyboard_lost();
+		void report_changed(report_type type);
+		void commit_reports();
 
 		void print_stack();
 
-		template<uint16_t ms>
-		void beep() const {
-			command(::keyboard::command::bell_on);
-			_delay_ms(ms);
-			command(::keyboard::command::bell_off);
+		void beep(uint8_t ms) {
+			m_feedback.tone(ms);
+		}
+
+		void beep_error() {
+			m_feedback.tone(50);
+			m_feedback.pause(50);
+			m_feedback.tone(50);
 		}
 
 		void reset_led() {
-			command(::keyboard::command::led_status, m_ledState);
+			m_commands.leds(m_ledState);
 		}
 
 		void set_ledstate(uint8_t state) {
 			m_ledState = state;
-			command(::keyboard::command::led_status, m_ledState);
+			m_commands.leds(m_ledState);
+			save_warm();
 		}
 		void set_led(::keyboard::led led) {
-			command(::keyboard::command::led_status, m_ledState | static_cast<uint8_t>(led));
+			m_commands.leds(m_ledState | static_cast<uint8_t>(led));
 		}
 
-		void command(::keyboard::command command) const {
-			uart::send(as_byte(command));
-		}
-		void command(::keyboard::command command, uint8_t payload) const {
-			uart::send(as_byte(command), payload);
+		// Only bells can be refused when the queue is full
+		bool command(::keyboard::command command) {
+			if (command == ::keyboard::command::click_on) {
+				m_click = true;
+			} else if (command == ::keyboard::command::click_off) {
+				m_click = false;
+			}
+			return m_commands.push(command);
 		}
 
 		report_type press(KeyUsage key);
 		report_type release(KeyUsage key);
 
+		// Modifier byte of the report carrying keyboard input
+		uint8_t& modifiers() {
+#if KEYBOARD_NKRO
+			return nkro_report.modMask;
+#else
+			return key_report.modMask;
+#endif
+		}
+		void clear_keys();
+		void fill_keys(KeyUsage key);
+
 	public:
 		static constexpr uint8_t protocol_report = 1;
 		static constexpr uint8_t protocol_boot = 0;
 
 		keyhandler() noexcept :
-			boot_report_data{0}, key_report_data{0}, media_report_data{0}, system_report_data{0},
-			m_mode(mode::off), m_keystate(keystate::clear),
-			m_curOverride(0), m_macroBuffer{0},
-			m_ledState(0), m_protocol(protocol_report)
+			boot_report_data{0},
+#if !KEYBOARD_NKRO
+			key_report_data{0},
+#endif
+#if KEYBOARD_MEDIA_KEYS
+			media_report_data{0}, system_report_data{0},
+#endif
+			m_mode(mode::off), m_resumeMode(mode::normal), m_click(false), m_keystate(keystate::clear),
+#if KEYBOARD_KEY_SWAP
+			m_curOverride(0),
+#endif
+#if KEYBOARD_MACROS
+			m_macros(), m_lastMacro(0),
+			m_macroSpeed(macro_speed::original), m_macroReader(), m_macroPlaying(false),
+			m_macroHasNext(false), m_macroNext(0), m_macroDue(0), m_macroFrame(0), m_macroHeld{0},
+#endif
+			m_ledState(0), m_protocol(protocol_report), m_keymap(), m_writeBeep(0),
+			m_reports(), m_pendingReports(0),
+#if KEYBOARD_MEDIA_ENDPOINT
+			m_mediaReports(),
+#endif
+			m_dirtyReports(0), m_lastSof(0), m_dirtyBreak(0)
 		{
+#if KEYBOARD_NKRO
+			memset(nkro_report_data, 0, sizeof(nkro_report_data));
+			nkro_report.report_id = report_type::nkro;
+			m_nkroKeys = 0;
+#else
 			key_report.report_id = report_type::key;
+#endif
+#if KEYBOARD_MEDIA_KEYS
 			media_report.report_id = report_type::media;
 			system_report.report_id = report_type::system;
+#endif
 		}
 
-		void init() {
+		// Warm after a watchdog reset with valid warm::state
+		void init(bool warm) {
 			// B0: keyboard. B1: LED
 			DDRB |= _BV(PORTB0) | _BV(PORTB1);
 			check_config();
+			if (warm) {
+				restore_warm();
+			}
 			//command(::keyboard::command::reset);
 		}
 
@@ -231,6 +400,8 @@ namespace keyboard {
 				m_mode = mode::reset; // keyboard performs self-test on powerup
 				m_keystate = keystate::clear;
 				PORTB |= _BV(PORTB0);
+				boot::mark(boot::stage::keyboard_power);
+				save_warm();
 			}
 		}
 
@@ -238,6 +409,26 @@ namespace keyboard {
 			if (m_mode != mode::off) {
 				m_mode = mode::off;
 				PORTB &= ~_BV(PORTB0);
+				save_warm();
+			}
+		}
+
+		// Bus suspended. Held keys are released towards the host once it
+		// is back. The keyboard only keeps power when it may wake the host,
+		// which exceeds the suspend current limit.
+		void suspend(bool wakeup) {
+			keyboard_lost();
+			if (!wakeup) {
+				disable();
+			}
+		}
+
+		// The self-test after power up or a reset restores the keyboard
+		void resume() {
+			if (m_mode == mode::off) {
+				enable();
+			} else {
+				command(::keyboard::command::reset);
 			}
 		}
 
@@ -253,24 +444,53 @@ namespace keyboard {
 				m_protocol = protocol;
 				PORTB |= _BV(PORTB1);
 			}
+			save_warm();
 		}
 
 		void poll_event();
 
+		// Nothing left that can go on before the next interrupt
+		bool idle() const {
+			if (uart::poll() || m_pendingReports) {
+				return false;
+			}
+			if (m_dirtyReports && usbSofCount != m_lastSof) {
+				return false;
+			}
+#if KEYBOARD_MEDIA_ENDPOINT
+			if (!m_mediaReports.empty() && usbInterruptIsReady3()) {
+				return false;
+			}
+#endif
+			return m_reports.empty() || !usbInterruptIsReady();
+		}
+
+		bool reports_queued() const {
+#if KEYBOARD_MEDIA_ENDPOINT
+			if (!m_mediaReports.empty()) {
+				return true;
+			}
+#endif
+			return m_dirtyReports || m_pendingReports || !m_reports.empty();
+		}
+
 		void set_led_report(unsigned char data);
 
 		void send_report_intr(report_type type);
 
-		void update_boot_report() {
-			boot_report.modMask = key_report.modMask;
-			boot_report.keys = key_report.keys;
-		}
+		report_type flush_reports();
+#if KEYBOARD_MEDIA_ENDPOINT
+		report_type flush_media_reports();
+#endif
+
+		void update_boot_report();
 
 		uint8_t set_report_ptr(unsigned char* *ptr, uint8_t main_type, report_type type) {
 			if (main_type != 1) {
 				//return 0;
 			}
-			if (m_protocol == protocol_boot) {
+			bool keys = type != report_type::media && type != report_type::system;
+			if (m_protocol == protocol_boot && keys) {
 				update_boot_report();
 				*ptr = const_cast<unsigned char*>(boot_report_data);
 				return sizeof(boot_report_data);
@@ -278,9 +498,16 @@ namespace keyboard {
 				switch(type) {
 					default:
 					case report_type::key:
+					case report_type::nkro:
 						// Keyboard
+#if KEYBOARD_NKRO
+						*ptr = const_cast<unsigned char*>(nkro_report_data);
+						return sizeof(nkro_report_data);
+#else
 						*ptr = const_cast<unsigned char*>(key_report_data);
 						return sizeof(key_report_data);
+#endif
+#if KEYBOARD_MEDIA_KEYS
 					case report_type::media:
 						// Media
 						*ptr = const_cast<unsigned char*>(media_report_data);
@@ -289,6 +516,7 @@ namespace keyboard {
 						// System
 						*ptr = const_cast<unsigned char*>(system_report_data);
 						return sizeof(system_report_data);
+#endif
 				}
 			}
 		}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "timer.h"
+
+#include <stdint.h>
+
+namespace boot {
+	// Milestones from power up to the first key, time-to-first-key is
+	// the last stamp
+	enum class stage : uint8_t {
+		configured,     // Host set the USB configuration
+		keyboard_power, // Keyboard switched on
+		keyboard_ready, // Self-test passed
+		first_key,      // First make code received
+		count
+	};
+
+	// Milliseconds since the timer started, 0 until the stage is reached
+	extern uint16_t stamps[static_cast<uint8_t>(stage::count)];
+
+	inline void mark(stage s) {
+		auto& stamp = stamps[static_cast<uint8_t>(s)];
+		if (stamp == 0) {
+			auto now = timer::millis();
+			stamp = now ? now : 1;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "commands.h"
+#include "uart.h"
+#include "usb/report.h"
+
+#include <stdint.h>
+
+namespace keyboard {
+	// Commands waiting for room in the UART transmit buffer. Bell
+	// commands go out first and in order. The other commands set state
+	// or request an answer, so each has one slot that collapses repeats:
+	// a burst of host LED updates sends only the latest state, and a
+	// storm of resets or probes sends just one. Nothing but bells can be
+	// refused, and those are only pushed while there is room.
+	class command_queue {
+	public:
+		bool push(command cmd) {
+			switch (cmd) {
+				case command::reset:
+					// Anything still queued is void after the reset
+					m_commands.clear();
+					m_reset = true;
+					return true;
+				case command::layout:
+					m_layout = true;
+					return true;
+				case command::click_on:
+				case command::click_off:
+					m_click = cmd;
+					return true;
+				default:
+					return m_commands.push(as_byte(cmd));
+			}
+		}
+
+		void leds(uint8_t state) {
+			m_leds = state;
+			m_ledsPending = true;
+		}
+
+		bool full() const {
+			return m_commands.full();
+		}
+
+		bool empty() const {
+			return m_commands.empty() && !m_ledsPending && !m_reset && !m_layout &&
+				m_click == command::none;
+		}
+
+		// Hands commands to the UART, called from the main loop
+		void pump() {
+			if (m_reset) {
+				if (!uart::send(as_byte(command::reset))) {
+					return;
+				}
+				m_reset = false;
+			}
+			while (!m_commands.empty() && uart::send(m_commands.cur())) {
+				m_commands.pop();
+			}
+			if (!m_commands.empty()) {
+				return;
+			}
+			if (m_click != command::none && uart::send(as_byte(m_click))) {
+				m_click = command::none;
+			}
+			if (m_layout && uart::send(as_byte(command::layout))) {
+				m_layout = false;
+			}
+			if (m_click == command::none && !m_layout && m_ledsPending &&
+			  uart::send(as_byte(command::led_status), m_leds)) {
+				m_ledsPending = false;
+			}
+		}
+
+	private:
+		ring_buffer<4> m_commands;
+		uint8_t m_leds = 0;
+		bool m_ledsPending = false;
+		bool m_reset = false;
+		bool m_layout = false;
+		command m_click = command::none; // Latest click state to send
+
+	};
+}
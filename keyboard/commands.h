@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace keyboard {
+	enum class command : uint8_t {
+		none = 0x00,
+		// Commands to keyboard
+		reset = 0x01,
+		bell_on = 0x02,
+		bell_off = 0x03,
+		click_on = 0x0A,
+		click_off = 0x0B,
+		led_status = 0x0E,
+		layout = 0x0F,
+	};
+}
@@ -0,0 +1,153 @@
+#include "eeprom_queue.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+
+namespace eeprom_queue {
+	struct job {
+		uint8_t* dst;
+		const uint8_t* src; // Points at data for copied jobs
+		uint8_t length;
+		uint8_t data[copy_size];
+	};
+	static_assert((depth & (depth - 1)) == 0, "Depth must be a power of two");
+
+	static job jobs[depth];
+	static volatile uint8_t r_pos = 0;
+	static volatile uint8_t w_pos = 0;
+	static volatile bool error = false;
+
+	// Byte written by the last interrupt, verified by the next one
+	static uint8_t* verify_addr = nullptr;
+	static uint8_t verify_value;
+
+	static job* push(uint8_t* dst, const uint8_t* src, uint8_t length) {
+		if (static_cast<uint8_t>(w_pos - r_pos) == depth) {
+			return nullptr;
+		}
+		auto& j = jobs[w_pos & (depth - 1)];
+		j.dst = dst;
+		j.src = src;
+		j.length = length;
+		return &j;
+	}
+
+	static void commit() {
+		// Job must be complete before the interrupt can see it
+		__asm__ __volatile__("" ::: "memory");
+		w_pos = w_pos + 1;
+		EECR |= _BV(EERIE);
+	}
+
+	bool write(void* dst, const void* src, uint8_t length) {
+		if (length == 0) {
+			return true;
+		}
+		if (!push(static_cast<uint8_t*>(dst), static_cast<const uint8_t*>(src), length)) {
+			return false;
+		}
+		commit();
+		return true;
+	}
+
+	bool write_copy(void* dst, const void* src, uint8_t length) {
+		if (length == 0) {
+			return true;
+		}
+		if (length > copy_size) {
+			return false;
+		}
+		auto* j = push(static_cast<uint8_t*>(dst), nullptr, length);
+		if (!j) {
+			return false;
+		}
+		memcpy(j->data, src, length);
+		j->src = j->data;
+		commit();
+		return true;
+	}
+
+	bool write(uint8_t* dst, uint8_t value) {
+		return write_copy(dst, &value, 1);
+	}
+
+	bool busy() {
+		return r_pos != w_pos;
+	}
+
+	uint8_t pending() {
+		return static_cast<uint8_t>(w_pos - r_pos);
+	}
+
+	bool failed() {
+		cli();
+		bool e = error;
+		error = false;
+		sei();
+		return e;
+	}
+
+	static uint8_t read_byte(const uint8_t* src) {
+		EEAR = reinterpret_cast<uint16_t>(src);
+		EECR |= _BV(EERE);
+		return EEDR;
+	}
+
+	uint8_t read(const uint8_t* src) {
+		uint8_t c;
+		read(&c, src, 1);
+		return c;
+	}
+
+	void read(void* dst, const void* src, uint8_t length) {
+		// Keep the interrupt away from the address registers while reading
+		uint8_t enabled = EECR & _BV(EERIE);
+		EECR &= ~_BV(EERIE);
+		while (EECR & _BV(EEPE));
+
+		auto* d = static_cast<uint8_t*>(dst);
+		auto* s = static_cast<const uint8_t*>(src);
+		while (length--) {
+			*d++ = read_byte(s++);
+		}
+
+		EECR |= enabled;
+	}
+}
+
+using namespace eeprom_queue;
+
+ISR(EE_READY_vect) {
+	// One byte per interrupt keeps the USB interrupt latency low
+	if (verify_addr) {
+		if (read_byte(verify_addr) != verify_value) {
+			error = true;
+		}
+		verify_addr = nullptr;
+	}
+
+	if (r_pos == w_pos) {
+		EECR &= ~_BV(EERIE);
+		return;
+	}
+
+	auto& j = jobs[r_pos & (depth - 1)];
+	if (j.length == 0) {
+		r_pos = r_pos + 1;
+		return;
+	}
+
+	uint8_t value = *j.src++;
+	uint8_t* addr = j.dst++;
+	j.length--;
+
+	if (read_byte(addr) != value) {
+		// Erase and write, EEAR still points at addr
+		EEDR = value;
+		EECR = _BV(EEMPE) | _BV(EERIE);
+		EECR |= _BV(EEPE);
+		verify_addr = addr;
+		verify_value = value;
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// Background EEPROM writer. Jobs are written byte by byte from the
+// EE_READY interrupt, skipping bytes that already hold the right value,
+// and each written byte is read back to verify it.
+namespace eeprom_queue {
+	static constexpr uint8_t depth = 4;
+
+	// Short writes are copied into the job, so the source may change
+	// right after the call
+	static constexpr uint8_t copy_size = 4;
+
+	// The source buffer must stay valid until busy() returns false
+	bool write(void* dst, const void* src, uint8_t length);
+	bool write_copy(void* dst, const void* src, uint8_t length);
+	bool write(uint8_t* dst, uint8_t value);
+
+	bool busy();
+	uint8_t pending();
+
+	// Whether a write failed to verify since the last call
+	bool failed();
+
+	// Reads are safe while jobs are pending, they wait for at most the
+	// byte currently being written
+	uint8_t read(const uint8_t* src);
+	void read(void* dst, const void* src, uint8_t length);
+}
@@ -0,0 +1,87 @@
+#include "feedback.h"
+#include "timer.h"
+
+namespace keyboard {
+	namespace {
+		constexpr uint8_t morse_short = 75;
+		constexpr uint8_t morse_long = 150;
+		constexpr uint8_t morse_gap = 75;
+		constexpr uint8_t morse_char_gap = 150;
+	}
+
+	bool feedback::tone(uint8_t ms) {
+		return push(kind::tone, ms);
+	}
+
+	bool feedback::pause(uint8_t ms) {
+		return push(kind::pause, ms);
+	}
+
+	bool feedback::morse(uint8_t code) {
+		return push(kind::morse, code);
+	}
+
+	bool feedback::push(kind type, uint8_t arg) {
+		if (static_cast<uint8_t>(m_write - m_read) == depth) {
+			return false;
+		}
+		m_steps[m_write & (depth - 1)] = {type, arg};
+		m_write++;
+		return true;
+	}
+
+	void feedback::wait(uint16_t now, uint8_t ms) {
+		m_until = now + ms;
+		m_waiting = true;
+	}
+
+	command feedback::start_tone(uint16_t now, uint8_t ms, uint8_t gap) {
+		m_bell = true;
+		m_gap = gap;
+		wait(now, ms);
+		return command::bell_on;
+	}
+
+	command feedback::poll(uint16_t now) {
+		if (m_waiting) {
+			if (!timer::reached(now, m_until)) {
+				return command::none;
+			}
+			m_waiting = false;
+			if (m_bell) {
+				m_bell = false;
+				if (m_gap) {
+					wait(now, m_gap);
+				}
+				return command::bell_off;
+			}
+		}
+
+		if (m_morseLen) {
+			uint8_t ms = (m_morseBits & 0x80) ? morse_long : morse_short;
+			m_morseBits <<= 1;
+			m_morseLen--;
+			return start_tone(now, ms, m_morseLen ? morse_gap : morse_gap + morse_char_gap);
+		}
+
+		if (m_read == m_write) {
+			return command::none;
+		}
+		auto s = m_steps[m_read & (depth - 1)];
+		m_read++;
+
+		switch (s.type) {
+			case kind::tone:
+				return start_tone(now, s.arg, 0);
+			case kind::pause:
+				wait(now, s.arg);
+				return command::none;
+			case kind::morse:
+				// Length in the top 3 bits, symbols in the lower 5
+				m_morseLen = s.arg >> 5;
+				m_morseBits = s.arg << 3;
+				return poll(now);
+		}
+		return command::none;
+	}
+}
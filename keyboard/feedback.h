@@ -0,0 +1,47 @@
+#pragma once
+
+#include "commands.h"
+
+#include <stdint.h>
+
+namespace keyboard {
+	// Queue of bell and Morse feedback played back in the
+	// background. poll() hands out the keyboard commands at the right
+	// time, so the main loop never has to wait for a beep to finish.
+	class feedback {
+	public:
+		bool tone(uint8_t ms);
+		bool pause(uint8_t ms);
+		bool morse(uint8_t code);
+
+		// Returns the command to send now, command::none if nothing is due
+		command poll(uint16_t now);
+
+	private:
+		enum class kind : uint8_t {
+			tone,
+			pause,
+			morse,
+		};
+		struct step {
+			kind type;
+			uint8_t arg;
+		};
+		static constexpr uint8_t depth = 8;
+
+		bool push(kind type, uint8_t arg);
+		command start_tone(uint16_t now, uint8_t ms, uint8_t gap);
+		void wait(uint16_t now, uint8_t ms);
+
+		step m_steps[depth];
+		uint8_t m_read = 0;
+		uint8_t m_write = 0;
+
+		bool m_waiting = false;
+		bool m_bell = false;
+		uint8_t m_gap = 0;        // Silence after the current tone
+		uint16_t m_until = 0;
+		uint8_t m_morseLen = 0;   // Symbols left of the current character
+		uint8_t m_morseBits = 0;  // Remaining symbols, MSB first, 1 is long
+	};
+}
@@ -1,15 +1,116 @@
 #include "keymap.h"
+#include "eeprom_queue.h"
+
+#define DIM(x) (sizeof(x)/sizeof(x[0]))
 
 namespace keyboard {
 
-	const PROGMEM KeyUsage keymap_flash[0x7F] =
+	const PROGMEM KeyUsage keymap_us[0x7F] =
+#include "keymap.inc"
+	;
+
+	// Extra key left of Z, non-US # and ~ next to enter
+#define KEYMAP_58 KeyUsage::POUND
+#define KEYMAP_7C KeyUsage::BACKSLASH_INT
+	const PROGMEM KeyUsage keymap_iso[0x7F] =
 #include "keymap.inc"
 	;
 
-	EEMEM KeyUsage keymap_eeprom[0x7F] =
+	// Conversion keys around the space bar, Ro left of right shift
+#define KEYMAP_73 KeyUsage::INTERNATIONAL5
+#define KEYMAP_74 KeyUsage::INTERNATIONAL4
+#define KEYMAP_75 KeyUsage::INTERNATIONAL2
+#define KEYMAP_7C KeyUsage::INTERNATIONAL1
+	const PROGMEM KeyUsage keymap_jp[0x7F] =
 #include "keymap.inc"
 	;
 
-	EEMEM uint8_t keymap_eeprom_version = 2;
+	EEMEM uint8_t keymap_eeprom_version = keymap_version;
+	EEMEM uint8_t keymap_override_count = 0;
+	EEMEM keymap_override keymap_overrides[keymap_max_overrides];
+
+	void keymap_cache::load() {
+		m_count = eeprom_queue::read(&keymap_override_count);
+		if (!features::key_swap || m_count > keymap_max_overrides) {
+			m_count = 0;
+		}
+		eeprom_queue::read(m_overrides, keymap_overrides, m_count * sizeof(keymap_override));
+	}
+
+	bool keymap_cache::reset() {
+		m_count = 0;
+		return eeprom_queue::write(&keymap_override_count, m_count);
+	}
+
+	void keymap_cache::select_layout(uint8_t layout) {
+		m_layout = layout;
+		if (layout == layout::japanese) {
+			m_table = keymap_jp;
+		} else if ((layout >= 0x23 && layout <= layout::uk) || layout == layout::canadian_french) {
+			// European layouts
+			m_table = keymap_iso;
+		} else {
+			m_table = keymap_us;
+		}
+	}
+
+	KeyUsage keymap_cache::lookup(uint8_t c) const {
+		if (c >= DIM(keymap_us)) {
+			return KeyUsage::RESERVED;
+		}
+		for (uint8_t i = 0; i < m_count; i++) {
+			if (m_overrides[i].code == c) {
+				return m_overrides[i].key;
+			}
+		}
+		return static_cast<KeyUsage>(pgm_read_byte_near(m_table + c));
+	}
+
+	KeyUsage keymap_cache::base(uint8_t c) const {
+		if (c >= DIM(keymap_us)) {
+			return KeyUsage::RESERVED;
+		}
+		return static_cast<KeyUsage>(pgm_read_byte_near(m_table + c));
+	}
+
+	bool keymap_cache::set(uint8_t c, KeyUsage key) {
+		if (c >= DIM(keymap_us)) {
+			return false;
+		}
+		bool original = key == base(c);
+
+		// Worst case is an entry and the count
+		if (eeprom_queue::depth - eeprom_queue::pending() < 2) {
+			return false;
+		}
+
+		for (uint8_t i = 0; i < m_count; i++) {
+			if (m_overrides[i].code != c) {
+				continue;
+			}
+			if (original) {
+				// Move the last entry into this slot before shrinking, so
+				// the list stays valid should power fail in between
+				m_overrides[i] = m_overrides[--m_count];
+				eeprom_queue::write(&keymap_overrides[i], &m_overrides[i], sizeof(keymap_override));
+				eeprom_queue::write(&keymap_override_count, m_count);
+			} else {
+				m_overrides[i].key = key;
+				eeprom_queue::write(&keymap_overrides[i].key, &m_overrides[i].key, 1);
+			}
+			return true;
+		}
 
+		if (original) {
+			return true;
+		}
+		if (m_count == cache_size) {
+			return false;
+		}
+		m_overrides[m_count] = {c, key};
+		eeprom_queue::write(&keymap_overrides[m_count], &m_overrides[m_count], sizeof(keymap_override));
+		m_count++;
+		eeprom_queue::write(&keymap_override_count, m_count);
+		return true;
+	}
 }
\ No newline at end of file
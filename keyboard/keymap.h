@@ -1,5 +1,6 @@
 #pragma once
 
+#include "options.h"
 #include "usb/report.h"
 
 #include <avr/eeprom.h>
@@ -7,12 +8,64 @@
 #include <stdint.h>
 
 namespace keyboard {
-	extern const PROGMEM KeyUsage keymap_flash[0x7F];
-	extern EEMEM KeyUsage keymap_eeprom[0x7F];
+	// One table per physical layout, selected by the layout code the
+	// keyboard reports
+	extern const PROGMEM KeyUsage keymap_us[0x7F];
+	extern const PROGMEM KeyUsage keymap_iso[0x7F];
+	extern const PROGMEM KeyUsage keymap_jp[0x7F];
 
-	constexpr uint8_t keymap_version = 2;
+	namespace layout {
+		constexpr uint8_t us = 0x21;
+		constexpr uint8_t us_unix = 0x22;
+		constexpr uint8_t german = 0x25;
+		constexpr uint8_t uk = 0x2E;
+		constexpr uint8_t japanese = 0x31;
+		constexpr uint8_t canadian_french = 0x32;
+	}
+
+	constexpr uint8_t keymap_version = 6;
 	extern EEMEM uint8_t keymap_eeprom_version;
 
+	// Keys remapped by the user, stored as a list of changes to the
+	// layout table rather than a full copy of the keymap
+	struct keymap_override {
+		uint8_t code;
+		KeyUsage key;
+	};
+	static_assert(sizeof(keymap_override) == 2, "Invalid override size");
+
+	constexpr uint8_t keymap_max_overrides = 16;
+	extern EEMEM uint8_t keymap_override_count;
+	extern EEMEM keymap_override keymap_overrides[keymap_max_overrides];
+
+	// RAM copy of the override list, so that a lookup never touches the
+	// EEPROM. Changes are queued for the EEPROM writer, which reads the
+	// new entries from this cache.
+	class keymap_cache {
+	public:
+		void load();
+		bool reset();
+
+		void select_layout(uint8_t layout);
+		uint8_t layout() const {
+			return m_layout;
+		}
+
+		KeyUsage lookup(uint8_t c) const;
+		// Usage from the layout table, ignoring overrides
+		KeyUsage base(uint8_t c) const;
+		bool set(uint8_t c, KeyUsage key);
+
+	private:
+		// Without key swap the EEPROM layout stays, but nothing is cached
+		// (an array cannot be empty)
+		static constexpr uint8_t cache_size = features::key_swap ? keymap_max_overrides : 1;
+		keymap_override m_overrides[cache_size];
+		uint8_t m_count = 0;
+		const KeyUsage* m_table = keymap_us;
+		uint8_t m_layout = 0; // Code the keyboard reported, 0 if none
+	};
+
 	namespace keys {
 		constexpr uint8_t help = 0x76;
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "timer.h"
+
+#include <stdint.h>
+
+namespace keyboard {
+	// Watches for a keyboard that stopped answering. A Sun keyboard is
+	// silent while no key changes, so after a quiet interval it is sent
+	// a probe, which it must answer within the timeout.
+	class link_monitor {
+	public:
+		static constexpr uint16_t probe_interval = 1000;
+		static constexpr uint16_t probe_timeout = 250;
+
+		enum class action : uint8_t {
+			none,
+			probe, // Send a command the keyboard answers
+			lost,  // Probe went unanswered
+		};
+
+		void received(uint16_t now) {
+			m_last = now;
+			m_probing = false;
+		}
+
+		action poll(uint16_t now) {
+			if (m_probing) {
+				if (!timer::reached(now, m_last + probe_timeout)) {
+					return action::none;
+				}
+				m_probing = false;
+				m_last = now;
+				return action::lost;
+			}
+			if (!timer::reached(now, m_last + probe_interval)) {
+				return action::none;
+			}
+			m_probing = true;
+			m_last = now;
+			return action::probe;
+		}
+
+	private:
+		uint16_t m_last = 0; // Last byte received, or probe sent
+		bool m_probing = false;
+	};
+}
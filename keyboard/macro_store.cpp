@@ -0,0 +1,292 @@
+#include "macro_store.h"
+
+namespace keyboard {
+	EEMEM uint8_t macro_heap[macro_heap_size] = {macro_end};
+
+	namespace {
+		constexpr uint16_t macro_none = 0xFFFF;
+
+		// Compact once deleted records exist and less than this is left
+		constexpr uint16_t compact_threshold = 128;
+	}
+
+	void macro_reader::open(const uint8_t* data, uint8_t length) {
+		m_pos = data;
+		m_end = data + length;
+		m_runLeft = 0;
+	}
+
+	bool macro_reader::next(uint8_t& c, uint16_t& delay) {
+		delay = 0;
+		for (;;) {
+			if (m_runLeft) {
+				// Runs start with the make
+				m_runLeft--;
+				c = (m_runLeft & 1) ? m_runCode : (m_runCode | 0x80);
+				return true;
+			}
+			if (m_pos == m_end) {
+				return false;
+			}
+			c = eeprom_queue::read(m_pos++);
+			if (c == macro_run && m_end - m_pos >= 2) {
+				m_runLeft = eeprom_queue::read(m_pos) * 2;
+				m_runCode = eeprom_queue::read(m_pos + 1);
+				m_pos += 2;
+			} else if (c == macro_delay) {
+				uint16_t steps = 0;
+				uint8_t shift = 0;
+				while (m_pos != m_end && shift < 16) {
+					uint8_t b = eeprom_queue::read(m_pos++);
+					steps |= static_cast<uint16_t>(b & 0x7F) << shift;
+					shift += 7;
+					if (!(b & 0x80)) {
+						break;
+					}
+				}
+				uint16_t ms = steps > macro_max_delay / macro_delay_unit ? macro_max_delay : steps * macro_delay_unit;
+				delay = (macro_max_delay - delay < ms) ? macro_max_delay : delay + ms;
+			} else {
+				return true;
+			}
+		}
+	}
+
+	void macro_store::load() {
+		m_tail = 0;
+		m_dead = 0;
+		m_length = 0;
+		m_compacting = false;
+		while (m_tail < macro_heap_size) {
+			uint8_t key = eeprom_queue::read(macro_heap + m_tail);
+			if (key == macro_end) {
+				return;
+			}
+			uint8_t length = eeprom_queue::read(macro_heap + m_tail + 1);
+			if (m_tail + 2 + length >= macro_heap_size) {
+				break;
+			}
+			if (key == macro_deleted) {
+				m_dead += 2 + length;
+			}
+			m_tail += 2 + length;
+		}
+		// Broken chain, drop what follows
+		if (m_tail < macro_heap_size) {
+			eeprom_queue::write(macro_heap + m_tail, macro_end);
+		}
+	}
+
+	bool macro_store::reset() {
+		m_tail = 0;
+		m_dead = 0;
+		m_length = 0;
+		m_compacting = false;
+		return eeprom_queue::write(macro_heap, macro_end);
+	}
+
+	uint16_t macro_store::find_offset(uint8_t key) const {
+		uint16_t found = macro_none;
+		for (uint16_t offset = 0; offset < m_tail; ) {
+			if (eeprom_queue::read(macro_heap + offset) == key) {
+				found = offset;
+			}
+			offset += 2 + eeprom_queue::read(macro_heap + offset + 1);
+		}
+		return found;
+	}
+
+	const uint8_t* macro_store::find(uint8_t key, uint8_t& length) const {
+		auto offset = find_offset(key);
+		if (offset == macro_none) {
+			return nullptr;
+		}
+		length = eeprom_queue::read(macro_heap + offset + 1);
+		return macro_heap + offset + 2;
+	}
+
+	bool macro_store::begin_record() {
+		if (m_compacting) {
+			return false;
+		}
+		// Room for the header and the end marker behind the data
+		uint16_t left = macro_heap_size - m_tail;
+		if (left < 3 + 1) {
+			return false;
+		}
+		left -= 3;
+		m_limit = left > 0xFF ? 0xFF : left;
+		m_length = 0;
+		m_make = 0;
+		m_runCount = 0;
+		m_timed = false;
+		return true;
+	}
+
+	bool macro_store::record(uint8_t c, uint16_t now) {
+		// Pauses split runs, everything before it goes out first
+		uint16_t delay = now - m_lastEvent;
+		bool pause = m_timed && delay >= macro_min_delay;
+		m_timed = true;
+		m_lastEvent = now;
+		if (pause) {
+			if (!flush_run() || (m_make && !emit(m_make)) || !emit_delay(delay)) {
+				return false;
+			}
+			m_make = 0;
+		}
+
+		if (m_make) {
+			if (c == (m_make | 0x80)) {
+				// Tapped key, extend the run if it is the same one
+				if (m_runCount && m_runCode == m_make && m_runCount < macro_max_run) {
+					m_runCount++;
+				} else {
+					if (!flush_run()) {
+						return false;
+					}
+					m_runCode = m_make;
+					m_runCount = 1;
+				}
+				m_make = 0;
+				return true;
+			}
+			if (!flush_run() || !emit(m_make)) {
+				return false;
+			}
+			m_make = 0;
+		}
+
+		if (!(c & 0x80)) {
+			m_make = c;
+			return true;
+		}
+		return flush_run() && emit(c);
+	}
+
+	bool macro_store::end_record() {
+		bool ok = flush_run() && (!m_make || emit(m_make));
+		m_make = 0;
+		// Write the partially filled stage
+		return write_stage(m_length & (stage_size - 1)) && ok;
+	}
+
+	bool macro_store::flush_run() {
+		uint8_t count = m_runCount;
+		m_runCount = 0;
+		if (count == 1) {
+			return emit(m_runCode) && emit(m_runCode | 0x80);
+		} else if (count > 1) {
+			return emit(macro_run) && emit(count) && emit(m_runCode);
+		}
+		return true;
+	}
+
+	bool macro_store::emit_delay(uint16_t ms) {
+		if (!emit(macro_delay)) {
+			return false;
+		}
+		uint16_t steps = ms / macro_delay_unit;
+		while (steps >= 0x80) {
+			if (!emit((steps & 0x7F) | 0x80)) {
+				return false;
+			}
+			steps >>= 7;
+		}
+		return emit(steps);
+	}
+
+	bool macro_store::emit(uint8_t c) {
+		if (m_length == m_limit) {
+			return false;
+		}
+		m_stage[m_length & (stage_size - 1)] = c;
+		m_length++;
+
+		// Write out the stage as it fills. The job takes a copy, should
+		// the EEPROM fall behind the queue fills up and recording stops.
+		if ((m_length & (stage_size - 1)) == 0) {
+			return write_stage(stage_size);
+		}
+		return true;
+	}
+
+	bool macro_store::write_stage(uint8_t length) {
+		uint8_t pos = (m_length - 1) & ~(stage_size - 1);
+		if (!eeprom_queue::write_copy(macro_heap + m_tail + 2 + pos, m_stage, length)) {
+			m_length = pos;
+			return false;
+		}
+		return true;
+	}
+
+	bool macro_store::save(uint8_t key) {
+		// Worst case is the header, end marker and deleting the old record
+		if (m_compacting || eeprom_queue::depth - eeprom_queue::pending() < 4) {
+			return false;
+		}
+		auto old = find_offset(key);
+
+		if (m_length) {
+			// The key goes last, until then the record is not part of the heap
+			uint16_t tail = m_tail + 2 + m_length;
+			eeprom_queue::write(macro_heap + m_tail + 1, m_length);
+			eeprom_queue::write(macro_heap + tail, macro_end);
+			eeprom_queue::write(macro_heap + m_tail, key);
+			m_tail = tail;
+			m_length = 0;
+		}
+		if (old != macro_none) {
+			eeprom_queue::write(macro_heap + old, macro_deleted);
+			m_dead += 2 + eeprom_queue::read(macro_heap + old + 1);
+		}
+
+		if (m_dead && macro_heap_size - m_tail < compact_threshold) {
+			m_compacting = true;
+			m_compactSrc = 0;
+			m_compactDst = 0;
+			m_compactLeft = 0;
+		}
+		return true;
+	}
+
+	bool macro_store::poll() {
+		if (!m_compacting) {
+			return false;
+		}
+		if (eeprom_queue::busy()) {
+			return true;
+		}
+
+		// Slide live records down over deleted ones, a chunk at a time.
+		// Losing power halfway leaves a broken chain, which load() cuts
+		// off at the first bad record.
+		while (m_compactLeft == 0) {
+			if (m_compactSrc >= m_tail) {
+				eeprom_queue::write(macro_heap + m_compactDst, macro_end);
+				m_tail = m_compactDst;
+				m_dead = 0;
+				m_compacting = false;
+				return false;
+			}
+			uint8_t key = eeprom_queue::read(macro_heap + m_compactSrc);
+			uint16_t size = 2 + eeprom_queue::read(macro_heap + m_compactSrc + 1);
+			if (key == macro_deleted) {
+				m_compactSrc += size;
+			} else if (m_compactSrc == m_compactDst) {
+				m_compactSrc += size;
+				m_compactDst += size;
+			} else {
+				m_compactLeft = size;
+			}
+		}
+
+		uint8_t length = m_compactLeft > stage_size ? stage_size : m_compactLeft;
+		eeprom_queue::read(m_stage, macro_heap + m_compactSrc, length);
+		eeprom_queue::write(macro_heap + m_compactDst, m_stage, length);
+		m_compactSrc += length;
+		m_compactDst += length;
+		m_compactLeft -= length;
+		return true;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "eeprom_queue.h"
+
+#include <avr/eeprom.h>
+#include <stdint.h>
+
+namespace keyboard {
+	// Macros live in one EEPROM heap of [key][length][data] records,
+	// chained by their lengths. A key of 0xFF (erased EEPROM) ends the
+	// heap, a key of 0 marks a deleted record that is reclaimed by
+	// compacting the heap in the background.
+	//
+	// Data is the recorded scancode stream, where a run of identical
+	// make/break pairs is stored as macro_run, count, scancode. A pause
+	// is stored as macro_delay followed by its length in macro_delay_unit
+	// steps, in 7 bit groups, least significant first, bit 7 set on all
+	// but the last.
+	constexpr uint16_t macro_heap_size = 476;
+	extern EEMEM uint8_t macro_heap[macro_heap_size];
+
+	constexpr uint8_t macro_end = 0xFF;
+	constexpr uint8_t macro_deleted = 0x00;
+	constexpr uint8_t macro_run = 0x7F; // Never a scancode, it is idle
+	constexpr uint8_t macro_max_run = 127;
+	constexpr uint8_t macro_delay = 0xFF; // Break of idle, never recorded
+	constexpr uint16_t macro_delay_unit = 16; // ms
+	// Shorter pauses are dropped, so the gaps of ordinary typing do not
+	// break up runs
+	constexpr uint16_t macro_min_delay = 256;
+	constexpr uint16_t macro_max_delay = 0x7FFF; // Longest pause played back
+
+	// Sequential reader of a record, expanding runs
+	class macro_reader {
+	public:
+		void open(const uint8_t* data, uint8_t length);
+		// Next scancode and the pause in ms before it
+		bool next(uint8_t& c, uint16_t& delay);
+
+	private:
+		const uint8_t* m_pos = nullptr;
+		const uint8_t* m_end = nullptr;
+		uint8_t m_runCode = 0;
+		uint8_t m_runLeft = 0;
+	};
+
+	class macro_store {
+	public:
+		void load();
+		bool reset();
+
+		// Data of the record for key, nullptr if there is none
+		const uint8_t* find(uint8_t key, uint8_t& length) const;
+
+		// Recording writes straight behind the last record. Nothing is
+		// visible until save() adds the header.
+		bool begin_record();
+		bool record(uint8_t c, uint16_t now);
+		bool end_record();
+		const uint8_t* recorded(uint8_t& length) const {
+			length = m_length;
+			return macro_heap + m_tail + 2;
+		}
+
+		// Stores the recording under key, replacing the previous one.
+		// An empty recording deletes it.
+		bool save(uint8_t key);
+
+		// Runs compaction, returns whether it is still busy
+		bool poll();
+		bool busy() const {
+			return m_compacting;
+		}
+
+	private:
+		bool emit(uint8_t c);
+		bool emit_delay(uint16_t ms);
+		bool flush_run();
+		bool write_stage(uint8_t length);
+		uint16_t find_offset(uint8_t key) const;
+
+		uint16_t m_tail = 0;  // Offset of the end marker
+		uint16_t m_dead = 0;  // Bytes held by deleted records
+
+		uint8_t m_length = 0; // Bytes recorded so far
+		uint8_t m_limit = 0;
+		uint8_t m_make = 0;   // Make waiting for its break, 0 if none
+		uint8_t m_runCode = 0;
+		uint8_t m_runCount = 0;
+		bool m_timed = false; // Whether m_lastEvent is set
+		uint16_t m_lastEvent = 0;
+
+		// Recorded bytes are staged until a copied EEPROM job is full, so
+		// the stage is free again right after. Compaction copies through
+		// it too.
+		static constexpr uint8_t stage_size = eeprom_queue::copy_size;
+		uint8_t m_stage[stage_size];
+
+		bool m_compacting = false;
+		uint16_t m_compactSrc = 0;
+		uint16_t m_compactDst = 0;
+		uint16_t m_compactLeft = 0;
+	};
+}
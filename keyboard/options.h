@@ -0,0 +1,69 @@
+#pragma once
+
+// Build options, set from CMake. The defaults here match the CMake option
+// defaults, so builds outside CMake get the same firmware.
+// KEYBOARD_BOOT_ONLY switches the defaults of the features off for a
+// plain 6 key boot keyboard.
+
+#ifndef KEYBOARD_BOOT_ONLY
+#define KEYBOARD_BOOT_ONLY 0
+#endif
+
+#ifndef KEYBOARD_COALESCE_REPORTS
+#define KEYBOARD_COALESCE_REPORTS 1
+#endif
+
+#ifndef KEYBOARD_NKRO
+#define KEYBOARD_NKRO !KEYBOARD_BOOT_ONLY
+#endif
+
+#ifndef KEYBOARD_MACROS
+#define KEYBOARD_MACROS !KEYBOARD_BOOT_ONLY
+#endif
+
+#ifndef KEYBOARD_MACRO_INTERVAL
+#define KEYBOARD_MACRO_INTERVAL 1
+#endif
+
+#ifndef KEYBOARD_MORSE
+#define KEYBOARD_MORSE !KEYBOARD_BOOT_ONLY
+#endif
+
+#ifndef KEYBOARD_KEY_SWAP
+#define KEYBOARD_KEY_SWAP !KEYBOARD_BOOT_ONLY
+#endif
+
+#ifndef KEYBOARD_MEDIA_KEYS
+#define KEYBOARD_MEDIA_KEYS !KEYBOARD_BOOT_ONLY
+#endif
+
+#if !KEYBOARD_MEDIA_KEYS
+#undef KEYBOARD_MEDIA_ENDPOINT
+#define KEYBOARD_MEDIA_ENDPOINT 0
+#elif !defined(KEYBOARD_MEDIA_ENDPOINT)
+#define KEYBOARD_MEDIA_ENDPOINT 1
+#endif
+
+#ifndef KEYBOARD_REMOTE_WAKEUP
+#define KEYBOARD_REMOTE_WAKEUP 0
+#endif
+
+#ifndef KEYBOARD_EARLY_POWER
+#define KEYBOARD_EARLY_POWER 0
+#endif
+
+namespace keyboard {
+	// The same options for plain if statements, which the compiler folds
+	// away. Members and descriptor items that go away use #if instead.
+	namespace features {
+		constexpr bool coalesce_reports = KEYBOARD_COALESCE_REPORTS;
+		constexpr bool nkro = KEYBOARD_NKRO;
+		constexpr bool macros = KEYBOARD_MACROS;
+		constexpr bool morse = KEYBOARD_MORSE;
+		constexpr bool key_swap = KEYBOARD_KEY_SWAP;
+		constexpr bool media_keys = KEYBOARD_MEDIA_KEYS; // Consumer and system reports
+		constexpr bool media_endpoint = KEYBOARD_MEDIA_ENDPOINT; // Media keys on interface 1, endpoint 3
+		constexpr bool remote_wakeup = KEYBOARD_REMOTE_WAKEUP;
+		constexpr bool early_power = KEYBOARD_EARLY_POWER; // Power the keyboard before configuration
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+namespace keyboard {
+	// FIFO of report snapshots waiting for a free interrupt-in frame.
+	// Snapshots are copied in, so the live reports may change while a
+	// previous state is still queued.
+	template<uint8_t Depth, uint8_t Width = 8>
+	class report_queue {
+		static_assert(Depth >= 2 && (Depth & (Depth - 1)) == 0, "Depth must be a power of two");
+	public:
+		struct entry {
+			uint8_t type;
+			uint8_t length;
+			uint8_t data[Width];
+		};
+
+		static constexpr uint8_t depth = Depth;
+
+		// Returns false and leaves the queue untouched when full
+		bool push(uint8_t type, const void* data, uint8_t length) {
+			if (full() || length > Width) {
+				return false;
+			}
+			auto& e = m_entries[m_write & (Depth - 1)];
+			e.type = type;
+			e.length = length;
+			memcpy(e.data, data, length);
+			m_write++;
+			return true;
+		}
+
+		entry const& front() const {
+			return m_entries[m_read & (Depth - 1)];
+		}
+
+		void pop() {
+			m_read++;
+		}
+
+		uint8_t length() const {
+			return static_cast<uint8_t>(m_write - m_read);
+		}
+
+		uint8_t free() const {
+			return Depth - length();
+		}
+
+		bool full() const {
+			return length() == Depth;
+		}
+
+		bool empty() const {
+			return m_write == m_read;
+		}
+
+		void clear() {
+			m_read = m_write = 0;
+		}
+
+	private:
+		entry m_entries[Depth];
+		uint8_t m_read = 0;
+		uint8_t m_write = 0;
+	};
+}
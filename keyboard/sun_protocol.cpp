@@ -0,0 +1,125 @@
+#include "sun_protocol.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte_near(addr) (*(addr))
+#endif
+
+namespace keyboard {
+	namespace {
+		// Byte classes, only the responses that mean something in some
+		// state get their own
+		enum : uint8_t {
+			byte_make,
+			byte_ok,     // reset_ok, or a make
+			byte_fail1,  // reset_fail1, or a make
+			byte_fail2,  // reset_fail2, or a make
+			byte_idle,
+			byte_break,
+			byte_layout,
+			byte_reset,
+			byte_classes
+		};
+
+		enum : uint8_t {
+			state_keys,
+			state_reset,
+			state_reset_fail,
+			state_layout,
+			state_count
+		};
+
+		constexpr uint8_t classify(uint8_t c) {
+			if (c & 0x80) {
+				if (c == response::reset) {
+					return byte_reset;
+				} else if (c == response::layout) {
+					return byte_layout;
+				}
+				return byte_break;
+			}
+			switch (c) {
+				case response::idle:
+					return byte_idle;
+				case response::reset_ok:
+					return byte_ok;
+				case response::reset_fail1:
+					return byte_fail1;
+				case response::reset_fail2:
+					return byte_fail2;
+				default:
+					return byte_make;
+			}
+		}
+
+		// Next state in the high nibble, event type in the low nibble
+		constexpr uint8_t to(uint8_t state, sun_event::kind type) {
+			return (state << 4) | static_cast<uint8_t>(type);
+		}
+		using ev = sun_event::kind;
+
+		constexpr PROGMEM uint8_t transitions[state_count][byte_classes] = {
+			// make, ok, fail1, fail2, idle, break, layout, reset
+			{ // keys
+				to(state_keys, ev::make), to(state_keys, ev::make), to(state_keys, ev::make),
+				to(state_keys, ev::make), to(state_keys, ev::all_released), to(state_keys, ev::brk),
+				to(state_layout, ev::none), to(state_reset, ev::reset),
+			},
+			{ // reset, waiting for the self-test result
+				to(state_reset, ev::none), to(state_keys, ev::reset_ok), to(state_reset_fail, ev::none),
+				to(state_reset, ev::none), to(state_reset, ev::none), to(state_reset, ev::none),
+				to(state_layout, ev::none), to(state_reset, ev::reset),
+			},
+			{ // reset_fail1 seen
+				to(state_reset_fail, ev::none), to(state_reset_fail, ev::none), to(state_reset_fail, ev::none),
+				to(state_keys, ev::reset_fail), to(state_reset_fail, ev::none), to(state_reset_fail, ev::none),
+				to(state_layout, ev::none), to(state_reset, ev::reset),
+			},
+			{ // layout, any byte is the layout code
+				to(state_keys, ev::layout), to(state_keys, ev::layout), to(state_keys, ev::layout),
+				to(state_keys, ev::layout), to(state_keys, ev::layout), to(state_keys, ev::layout),
+				to(state_keys, ev::layout), to(state_keys, ev::layout),
+			},
+		};
+
+		constexpr sun_event event(uint8_t t, uint8_t c) {
+			return {static_cast<sun_event::kind>(t & 0x0F),
+				static_cast<ev>(t & 0x0F) == ev::brk ? static_cast<uint8_t>(c & 0x7F) : c};
+		}
+
+		// The decoder at compile time, for the checks below. Whether the
+		// bytes from a clean state give these events, and the last value.
+		template<uint8_t N>
+		constexpr bool decodes(const uint8_t (&bytes)[N], const ev (&events)[N], uint8_t value) {
+			uint8_t state = 0;
+			sun_event e{ev::none, 0};
+			for (uint8_t i = 0; i < N; i++) {
+				uint8_t t = transitions[state][classify(bytes[i])];
+				state = t >> 4;
+				e = event(t, bytes[i]);
+				if (e.type != events[i]) {
+					return false;
+				}
+			}
+			return e.value == value;
+		}
+
+		static_assert(decodes({0x1D, 0x9D, 0x7F}, {ev::make, ev::brk, ev::all_released}, 0x7F), "Keys");
+		static_assert(decodes({0x9D}, {ev::brk}, 0x1D), "Break without break bit");
+		static_assert(decodes({0x04, 0x7E, 0x01}, {ev::make, ev::make, ev::make}, 0x01), "Result codes are makes outside reset");
+		static_assert(decodes({0xFF, 0x04, 0x1D}, {ev::reset, ev::reset_ok, ev::make}, 0x1D), "Reset ok");
+		static_assert(decodes({0xFF, 0x7E, 0x01}, {ev::reset, ev::none, ev::reset_fail}, 0x01), "Reset failed");
+		static_assert(decodes({0xFF, 0x7F, 0x9D, 0x04}, {ev::reset, ev::none, ev::none, ev::reset_ok}, 0x04), "Keys ignored during reset");
+		static_assert(decodes({0xFF, 0xFF, 0x04}, {ev::reset, ev::reset, ev::reset_ok}, 0x04), "Repeated reset");
+		static_assert(decodes({0xFE, 0x21}, {ev::none, ev::layout}, 0x21), "Layout");
+		static_assert(decodes({0xFE, 0xFF, 0x1D}, {ev::none, ev::layout, ev::make}, 0x1D), "Layout byte is never a response");
+	}
+
+	sun_event sun_decoder::decode(uint8_t c) {
+		uint8_t t = pgm_read_byte_near(&transitions[m_state][classify(c)]);
+		m_state = t >> 4;
+		return event(t, c);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace keyboard {
+	namespace response {
+		// Responses from keyboard
+		constexpr uint8_t idle = 0x7F;
+		constexpr uint8_t layout = 0xFE; // followed by layout byte
+		constexpr uint8_t reset = 0xFF;  // followed by 0x04, then make codes or IDLE. When failed, 0x7E 0x01
+		constexpr uint8_t reset_ok = 0x04;
+		constexpr uint8_t reset_fail1 = 0x7E;
+		constexpr uint8_t reset_fail2 = 0x01;
+	};
+
+	struct sun_event {
+		enum class kind : uint8_t {
+			none,
+			make,         // value is the scancode
+			brk,          // value is the scancode, without break bit
+			all_released,
+			reset,        // keyboard restarted its self-test
+			reset_ok,
+			reset_fail,
+			layout,       // value is the layout code
+		};
+		kind type;
+		uint8_t value;
+	};
+
+	// Turns the byte stream of a Sun keyboard into events. Plain C++ so
+	// it can be built and exercised on a host as well.
+	class sun_decoder {
+	public:
+		sun_event decode(uint8_t c);
+
+		void clear() {
+			m_state = 0;
+		}
+
+	private:
+		uint8_t m_state = 0;
+	};
+}
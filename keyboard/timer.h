@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <util/atomic.h>
+
+namespace timer {
+	// Milliseconds since power up, advanced by the TIMER0 interrupt
+	extern volatile uint16_t ms;
+
+	// Ticks that found the main loop asleep or awake, cleared when read
+	// out by the stack/load report
+	extern volatile uint16_t idle_ticks;
+	extern volatile uint16_t busy_ticks;
+
+	// Milliseconds since the last SOF, the bus counts as suspended once
+	// it reaches suspend_timeout
+	extern volatile uint8_t sof_idle;
+	constexpr uint8_t suspend_timeout = 3;
+
+	inline uint16_t millis() {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			return ms;
+		}
+		return 0;
+	}
+
+	// Wrap-safe check whether the time stamp has passed
+	inline bool reached(uint16_t now, uint16_t stamp) {
+		return static_cast<int16_t>(now - stamp) >= 0;
+	}
+}
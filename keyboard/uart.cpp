@@ -5,18 +5,32 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 namespace uart {
-	// 8 single keypresses generate 24 symbols (due to 0x7f clear byte)
-	static ring_buffer<8*3> rx_buffer = ring_buffer<8*3>();
+	// At 1200 baud 16 bytes take over 130 ms to arrive, far longer than
+	// the main loop leaves the buffer alone
+	static ring_buffer<16> rx_buffer = ring_buffer<16>();
 	static ring_buffer<8> tx_buffer = ring_buffer<8>();
+	static volatile uint8_t rx_errors = 0;
+
+	// Load the first byte when the transmitter is idle. The interrupt
+	// only consumes while LENTXOK is set, so this never races with it.
+	static void start_tx() {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			if (!(LINENIR & _BV(LENTXOK))) {
+				LINDAT = tx_buffer.pop();
+				LINENIR |= _BV(LENTXOK);
+			}
+		}
+	}
 
 	void init(uint16_t baudrate, uint8_t sampling) {
 		// Reset uart
 		LINCR = _BV(LSWRES);
 
-		// INTR on RX and TX
-		LINENIR = _BV(LENRXOK);// | _BV(LENTXOK);
+		// INTR on RX, TX and line errors
+		LINENIR = _BV(LENRXOK) | _BV(LENERR);// | _BV(LENTXOK);
 
 		LINBTR = /*_BV(LDISR) | */static_cast<uint8_t>(sampling);
 
@@ -47,6 +61,15 @@ namespace uart {
 		rx_buffer.clear();
 	}
 
+	uint8_t errors() {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			uint8_t e = rx_errors;
+			rx_errors = 0;
+			return e;
+		}
+		return 0;
+	}
+
 	bool send(uint8_t c1, uint8_t c2) {
 		if (tx_buffer.free() < 2) {
 			return false;
@@ -54,37 +77,32 @@ namespace uart {
 
 		tx_buffer.push(c1);
 		tx_buffer.push(c2);
-		if (!(LINENIR & _BV(LENTXOK))) {
-			LINENIR |= _BV(LENTXOK);
-			LINDAT = tx_buffer.pop();
-		}
+		start_tx();
 		return true;
 	}
 
 	bool send(uint8_t c) {
-		if (tx_buffer.full()) {
+		if (!tx_buffer.push(c)) {
 			return false;
 		}
-
-		tx_buffer.push(c);
-		if (!(LINENIR & _BV(LENTXOK))) {
-			LINENIR |= _BV(LENTXOK);
-			LINDAT = tx_buffer.pop();
-		}
+		start_tx();
 		return true;
 	}
 }
 
+ISR(LIN_ERR_vect) {
+	// Framing and overrun errors, typically a (dis)connecting keyboard
+	uart::rx_errors |= LINERR;
+	LINSIR = _BV(LERR);
+}
+
 ISR(LIN_TC_vect) {
-	if (LINSIR & _BV(LRXOK)) {
-		if (!uart::rx_buffer.full()) {
-			uart::rx_buffer.push(LINDAT);
-		} else {
-			// Drop value
-			uint8_t c = LINDAT;
-		}
+	uint8_t status = LINSIR;
+	if (status & _BV(LRXOK)) {
+		// Dropped when full
+		uart::rx_buffer.push(LINDAT);
 	}
-	if (LINSIR & _BV(LTXOK)) {
+	if ((status & _BV(LTXOK)) && (LINENIR & _BV(LENTXOK))) {
 		if (!uart::tx_buffer.empty()) {
 			LINDAT = uart::tx_buffer.pop();
 		} else {
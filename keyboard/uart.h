@@ -2,59 +2,65 @@
 
 #include <stdint.h>
 
+// Single producer, single consumer FIFO shared between an interrupt and
+// the main loop. The indices run freely and are masked on access, each
+// side only ever writes its own index.
 template<uint8_t Size>
 class ring_buffer {
-	static_assert(Size >= 2, "Ringbuffer too small");
+	static_assert(Size >= 2 && Size <= 128 && (Size & (Size - 1)) == 0, "Size must be a power of two");
 public:
 	static constexpr uint8_t size = Size;
 
-	void push(uint8_t c) {
-		buffer[w_pos] = c;
-		w_pos = static_cast<uint8_t>(w_pos + 1) % Size;
+	// Producer side
+	bool push(uint8_t c) {
+		if (full()) {
+			return false;
+		}
+		buffer[w_pos & (Size - 1)] = c;
+		// Data must be stored before the consumer can see it
+		__asm__ __volatile__("" ::: "memory");
+		w_pos = w_pos + 1;
+		return true;
 	}
 
-	uint8_t cur() {
-		return buffer[r_pos];
+	// Consumer side
+	uint8_t cur() const {
+		return buffer[r_pos & (Size - 1)];
 	}
 
 	uint8_t pop() {
-		auto& c = buffer[r_pos];
-		r_pos = static_cast<uint8_t>(r_pos + 1) % Size;
+		uint8_t c = buffer[r_pos & (Size - 1)];
+		// Data must be read before the producer may overwrite it
+		__asm__ __volatile__("" ::: "memory");
+		r_pos = r_pos + 1;
 		return c;
 	}
 
-	uint8_t length() {
-		if (r_pos > w_pos) {
-			return Size - r_pos + w_pos;
-		} else {
-			return w_pos - r_pos;
-		}
+	void clear() {
+		r_pos = w_pos;
 	}
 
-	uint8_t free() {
-		if (r_pos > w_pos) {
-			return r_pos - w_pos;
-		} else {
-			return Size - w_pos + r_pos;
-		}
+	// Either side, exact for the caller's own end
+	uint8_t length() const {
+		return static_cast<uint8_t>(w_pos - r_pos);
+	}
+
+	uint8_t free() const {
+		return Size - length();
 	}
 
 	bool full() const {
-		return (w_pos + 1) % Size == r_pos;
+		return length() == Size;
 	}
 
 	bool empty() const {
 		return w_pos == r_pos;
 	}
 
-	void clear() {
-		r_pos = w_pos = 0;
-	}
-
 private:
 	uint8_t buffer[Size] = {0};
-	uint8_t r_pos = 0;
-	uint8_t w_pos = 0;
+	volatile uint8_t r_pos = 0;
+	volatile uint8_t w_pos = 0;
 };
 
 namespace uart {
@@ -69,6 +75,9 @@ namespace uart {
 	bool ready();
 	void clear();
 
+	// LINERR flags seen since the last call
+	uint8_t errors();
+
 	bool send(uint8_t c);
 	bool send(uint8_t c1, uint8_t c2);
 }
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include "usage_table.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte_near(addr) (*(addr))
+#endif
+
+namespace keyboard {
+	namespace usage_table {
+		const PROGMEM table_t routes = build(make_indices<256>::type{});
+
+		static_assert(classify(as_byte(KeyUsage::LEFTSHIFT)) == entry(usage_route::modifier, 1), "Bad modifier route");
+		static_assert(!features::media_keys || classify(as_byte(KeyUsage::VOLUME_DOWN)) == entry(usage_route::media, 2), "Bad media route");
+		static_assert(!features::media_keys || classify(as_byte(KeyUsage::POWER)) == entry(usage_route::power), "Bad power route");
+		static_assert(classify(as_byte(last_key_usage) + 1) == entry(usage_route::none), "Bad key range");
+
+		usage_route route(KeyUsage key, uint8_t& bit) {
+			uint8_t e = pgm_read_byte_near(routes.entries + as_byte(key));
+			bit = e & 0x1F;
+			return static_cast<usage_route>(e >> 5);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "options.h"
+#include <usb/report.h>
+
+#include <stdint.h>
+
+namespace keyboard {
+	// Highest usage in the key array or bitmap
+	static constexpr KeyUsage last_key_usage = KeyUsage::INTERNATIONAL5;
+
+	// Where a usage goes when pressed. Each entry holds the route in the
+	// top three bits and the bit within the report mask below it.
+	enum class usage_route : uint8_t {
+		none,
+		key,      // Key array or bitmap
+		modifier, // Modifier mask
+		media,    // Consumer report mask
+		power,    // System report, sleep or power depending on shift
+	};
+
+	namespace usage_table {
+		constexpr uint8_t entry(usage_route route, uint8_t bit = 0) {
+			return (static_cast<uint8_t>(route) << 5) | bit;
+		}
+
+		// One row per usage range, add rows for new usages. Without media
+		// keys their usages route nowhere.
+		constexpr uint8_t classify(uint8_t usage) {
+			return
+			  (usage >= as_byte(KeyUsage::LEFTCTRL) && usage <= as_byte(KeyUsage::RIGHTGUI)) ?
+				entry(usage_route::modifier, usage - as_byte(KeyUsage::LEFTCTRL)) :
+			  (features::media_keys && usage >= as_byte(KeyUsage::MUTE) && usage <= as_byte(KeyUsage::VOLUME_DOWN)) ?
+				entry(usage_route::media, usage - as_byte(KeyUsage::MUTE)) :
+			  (features::media_keys && usage == as_byte(KeyUsage::POWER)) ?
+				entry(usage_route::power) :
+			  (usage <= as_byte(last_key_usage)) ?
+				entry(usage_route::key) :
+				entry(usage_route::none);
+		}
+
+		// No <utility> on avr-gcc, so build the index list by hand
+		template<uint8_t... I>
+		struct indices {};
+
+		template<unsigned N, uint8_t... I>
+		struct make_indices : make_indices<N - 1, N - 1, I...> {};
+
+		template<uint8_t... I>
+		struct make_indices<0, I...> {
+			using type = indices<I...>;
+		};
+
+		template<uint8_t... I>
+		struct table {
+			uint8_t entries[sizeof...(I)];
+		};
+
+		template<uint8_t... I>
+		constexpr table<I...> build(indices<I...>) {
+			return table<I...>{{classify(I)...}};
+		}
+
+		using table_t = decltype(build(make_indices<256>::type{}));
+		extern const table_t routes;
+
+		usage_route route(KeyUsage key, uint8_t& bit);
+	}
+}
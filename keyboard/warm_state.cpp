@@ -0,0 +1,29 @@
+#include "warm_state.h"
+
+#include <stddef.h>
+#include <util/crc16.h>
+
+namespace keyboard {
+	namespace warm {
+		warm_state state __attribute__((section(".noinit")));
+
+		namespace {
+			uint16_t checksum() {
+				auto data = reinterpret_cast<const uint8_t*>(&state);
+				uint16_t crc = 0xFFFF;
+				for (uint8_t i = 0; i < offsetof(warm_state, crc); i++) {
+					crc = _crc16_update(crc, data[i]);
+				}
+				return crc;
+			}
+		}
+
+		void seal() {
+			state.crc = checksum();
+		}
+
+		bool valid() {
+			return state.crc == checksum();
+		}
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace keyboard {
+	// Handler state that survives a watchdog reset. It lives in .noinit
+	// RAM, the CRC tells a warm start from whatever power up left there.
+	struct warm_state {
+		uint8_t led_state;
+		uint8_t protocol;
+		uint8_t layout;
+		uint8_t macro_speed;
+		uint8_t last_macro;
+		bool powered; // Keyboard was switched on
+		uint16_t crc;
+	};
+
+	namespace warm {
+		extern warm_state state;
+
+		// Updates the CRC after changing state
+		void seal();
+		bool valid();
+	}
+}
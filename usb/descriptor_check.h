@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+// Compile-time walk over the short items of a HID report descriptor, for
+// static_asserts against the report structs. Long items, push and pop are
+// not used by any descriptor here and fail the check.
+namespace hid {
+	namespace item {
+		constexpr uint8_t type_mask = 0b1111'1100;
+
+		constexpr uint8_t input = 0b1000'0000;
+		constexpr uint8_t output = 0b1001'0000;
+		constexpr uint8_t feature = 0b1011'0000;
+		constexpr uint8_t collection = 0b1010'0000;
+		constexpr uint8_t end_collection = 0b1100'0000;
+		constexpr uint8_t report_size = 0b0111'0100;
+		constexpr uint8_t report_id = 0b1000'0100;
+		constexpr uint8_t report_count = 0b1001'0100;
+		constexpr uint8_t push = 0b1010'0100;
+		constexpr uint8_t pop = 0b1011'0100;
+		constexpr uint8_t long_item = 0b1111'1100;
+
+		constexpr unsigned data_size(uint8_t prefix) {
+			return (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+		}
+
+		constexpr uint32_t value(const char* data, unsigned size) {
+			uint32_t v = 0;
+			for (unsigned i = size; i > 0; i--) {
+				v = (v << 8) | static_cast<uint8_t>(data[i - 1]);
+			}
+			return v;
+		}
+	}
+
+	// Every item complete and every collection closed
+	constexpr bool balanced(const char* desc, unsigned length) {
+		int depth = 0;
+		unsigned pos = 0;
+		while (pos < length) {
+			uint8_t prefix = desc[pos];
+			uint8_t tag = prefix & item::type_mask;
+			if (prefix == item::long_item || tag == item::push || tag == item::pop) {
+				return false;
+			}
+			if (tag == item::collection) {
+				depth++;
+			} else if (tag == item::end_collection && --depth < 0) {
+				return false;
+			}
+			pos += 1 + item::data_size(prefix);
+		}
+		return pos == length && depth == 0;
+	}
+
+	// Bits of all main items of the given kind in report id, without the
+	// id byte itself. Use id 0 for descriptors without report ids.
+	constexpr unsigned report_bits(const char* desc, unsigned length, uint8_t kind, uint8_t id) {
+		unsigned bits = 0;
+		uint32_t size = 0;
+		uint32_t count = 0;
+		uint32_t current = 0;
+		for (unsigned pos = 0; pos < length; ) {
+			uint8_t prefix = desc[pos];
+			uint8_t tag = prefix & item::type_mask;
+			auto value = item::value(desc + pos + 1, item::data_size(prefix));
+			if (tag == item::report_size) {
+				size = value;
+			} else if (tag == item::report_count) {
+				count = value;
+			} else if (tag == item::report_id) {
+				current = value;
+			} else if (tag == kind && current == id) {
+				bits += size * count;
+			}
+			pos += 1 + item::data_size(prefix);
+		}
+		return bits;
+	}
+
+	// Bits a report struct carries after its id byte
+	template<typename Report>
+	constexpr unsigned payload_bits() {
+		return (sizeof(Report) - 1) * 8;
+	}
+}
@@ -1,15 +1,18 @@
 #include "descriptor_kbd.h"
+#include "descriptor_check.h"
 
 #include <avr/pgmspace.h>
 #include <usbconfig.h>
+#include <keyboard/Keyboard.h>
 
-/* USB report descriptor, size must match usbconfig.h */
-extern "C" PROGMEM const char usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
+/* USB report descriptor, checked against the report structs below */
+extern "C" constexpr PROGMEM char usbDescriptorHidReport[] = {
 	USAGE_PAGE(UsagePage::GenericDesktop),
 	USAGE(GenericDesktop::Keyboard),
 	COLLECTION(Collection::Application),
 	    REPORT_ID(1),
 		USAGE_PAGE(UsagePage::Keyboard),
+#if !KEYBOARD_NKRO
 		// Report modifier keys
 		REPORT_SIZE(1),
 		REPORT_COUNT(8),
@@ -22,10 +25,12 @@ extern "C" PROGMEM const char usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPT
 		REPORT_SIZE(8),
 		REPORT_COUNT(6),
 		USAGE_MIN(as_byte(KeyUsage::RESERVED)),
-		USAGE_MAX(as_byte(KeyUsage::VOLUME_DOWN)),
+		USAGE_MAX(as_byte(keyboard::last_key_usage)),
 		LOGICAL_MIN(as_byte(KeyUsage::RESERVED)),
-		LOGICAL_MAX(as_byte(KeyUsage::VOLUME_DOWN)),
+		// Two bytes, logical values are signed
+		LOGICAL_MAX(as_byte(keyboard::last_key_usage), 0),
 		INPUT(MainFlag::Data | MainFlag::Array | MainFlag::Absolute),
+#endif
 		// Status LEDs
 		REPORT_SIZE(1),
 		REPORT_COUNT(5),
@@ -38,40 +43,155 @@ extern "C" PROGMEM const char usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPT
 		REPORT_COUNT(3),
 		OUTPUT(MainFlag::Constant | MainFlag::Variable | MainFlag::Absolute),
 		USAGE_PAGE(UsagePage::Keyboard),
-	END_COLLECTION(),
-	USAGE_PAGE(UsagePage::Consumer),
-	USAGE(Consumer::Control),
-	COLLECTION(Collection::Application),
-	    REPORT_ID(2),
-		// Report media keys
+#if KEYBOARD_NKRO
+	    REPORT_ID(4),
+		// Report modifier keys
 		REPORT_SIZE(1),
-		REPORT_COUNT(3),
-		USAGE(Consumer::Mute),
-		USAGE(Consumer::VolumeInc),
-		USAGE(Consumer::VolumeDec),
+		REPORT_COUNT(8),
+		USAGE_MIN(as_byte(KeyUsage::LEFTCTRL)),
+		USAGE_MAX(as_byte(KeyUsage::RIGHTGUI)),
 		LOGICAL_MIN(0),
 		LOGICAL_MAX(1),
 		INPUT(MainFlag::Data | MainFlag::Variable | MainFlag::Absolute),
-		// Reserved
+		// Report keys, one bit each
 		REPORT_SIZE(1),
-		REPORT_COUNT(5),
-		INPUT(MainFlag::Constant | MainFlag::Variable | MainFlag::Absolute),
-	END_COLLECTION(),
-	USAGE_PAGE(UsagePage::GenericDesktop),
-	USAGE(GenericDesktop::SystemControl),
-	COLLECTION(Collection::Application),
-		REPORT_ID(3),
-		// Report system keys
-		REPORT_SIZE(1),
-		REPORT_COUNT(2),
-		USAGE(GenericDesktop::SystemPowerDown),
-		USAGE(GenericDesktop::SystemSleep),
-		LOGICAL_MIN(0),
-		LOGICAL_MAX(1),
+		REPORT_COUNT(keyboard::nkro_usage_count),
+		USAGE_MIN(as_byte(KeyUsage::RESERVED)),
+		USAGE_MAX(as_byte(keyboard::last_key_usage)),
 		INPUT(MainFlag::Data | MainFlag::Variable | MainFlag::Absolute),
-		// Reserved
+		// Padding
 		REPORT_SIZE(1),
-		REPORT_COUNT(6),
+		REPORT_COUNT(keyboard::nkro_key_bytes * 8 - keyboard::nkro_usage_count),
 		INPUT(MainFlag::Constant | MainFlag::Variable | MainFlag::Absolute),
+#endif
 	END_COLLECTION(),
+#if KEYBOARD_MEDIA_KEYS && !KEYBOARD_MEDIA_ENDPOINT
+#include "descriptor_media.inc"
+#endif
+};
+
+#if KEYBOARD_MEDIA_ENDPOINT
+/* Report descriptor of the second interface */
+extern "C" constexpr PROGMEM char usbDescriptorHidReportMedia[] = {
+#include "descriptor_media.inc"
+};
+#endif
+
+#if KEYBOARD_REMOTE_WAKEUP || KEYBOARD_MEDIA_ENDPOINT
+/* Replaces the driver's default to advertise remote wakeup and to add the
+ * media interface. It is served from usbFunctionDescriptor, like the HID
+ * descriptors inside it. */
+namespace {
+	constexpr uchar hid_descriptor_length = 9;
+	constexpr uchar interface_length = 9 + hid_descriptor_length + 7;
+	constexpr uchar interface_count = KEYBOARD_MEDIA_ENDPOINT ? 2 : 1;
+#if KEYBOARD_REMOTE_WAKEUP
+	constexpr uchar attributes = USBATTR_BUSPOWER | USBATTR_REMOTEWAKE;
+#else
+	constexpr uchar attributes = USBATTR_BUSPOWER;
+#endif
+}
+
+#define HID_INTERFACE(number, subclass, protocol, report, endpoint) \
+	9, USBDESCR_INTERFACE, \
+	number, \
+	0, /* Alternate setting */ \
+	1, /* Endpoints */ \
+	USB_CFG_INTERFACE_CLASS, subclass, protocol, \
+	0, /* No string */ \
+	hid_descriptor_length, USBDESCR_HID, \
+	0x01, 0x01, /* HID 1.1 */ \
+	0, /* No country code */ \
+	1, /* Report descriptors */ \
+	USBDESCR_HID_REPORT, \
+	sizeof(report) & 0xFF, sizeof(report) >> 8, \
+	7, USBDESCR_ENDPOINT, \
+	static_cast<char>(0x80 | (endpoint)), \
+	0x03, /* Interrupt */ \
+	8, 0, /* Packet size */ \
+	USB_CFG_INTR_POLL_INTERVAL
+
+extern "C" PROGMEM const char usbDescriptorConfiguration[] = {
+	9, USBDESCR_CONFIG,
+	9 + interface_count * interface_length, 0, // Total length
+	interface_count,
+	1, // Configuration value
+	0, // No string
+	static_cast<char>(attributes),
+	USB_CFG_MAX_BUS_POWER / 2, // In 2mA units
+	HID_INTERFACE(0, USB_CFG_INTERFACE_SUBCLASS, USB_CFG_INTERFACE_PROTOCOL, usbDescriptorHidReport, 1),
+#if KEYBOARD_MEDIA_ENDPOINT
+	// No boot protocol for consumer and system controls
+	HID_INTERFACE(1, 0, 0, usbDescriptorHidReportMedia, USB_CFG_EP3_NUMBER),
+#endif
 };
+static_assert(sizeof(usbDescriptorConfiguration) == 9 + interface_count * interface_length, "Invalid configuration descriptor");
+
+#undef HID_INTERFACE
+
+static usbMsgLen_t descriptorReply(const char* data, usbMsgLen_t length) {
+	usbMsgPtr = reinterpret_cast<uchar*>(const_cast<char*>(data));
+	return length;
+}
+
+extern "C" usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+	uchar interface = rq->wIndex.bytes[0];
+	switch (rq->wValue.bytes[1]) {
+		case USBDESCR_CONFIG:
+			return descriptorReply(usbDescriptorConfiguration, sizeof(usbDescriptorConfiguration));
+		case USBDESCR_HID:
+			if (interface >= interface_count) {
+				return 0;
+			}
+			return descriptorReply(usbDescriptorConfiguration + 9 + interface * interface_length + 9, hid_descriptor_length);
+		case USBDESCR_HID_REPORT:
+#if KEYBOARD_MEDIA_ENDPOINT
+			if (interface == 1) {
+				return descriptorReply(usbDescriptorHidReportMedia, sizeof(usbDescriptorHidReportMedia));
+			}
+#endif
+			return descriptorReply(usbDescriptorHidReport, sizeof(usbDescriptorHidReport));
+	}
+	return 0;
+}
+#endif
+
+namespace {
+	using namespace keyboard;
+
+	constexpr auto desc = usbDescriptorHidReport;
+	constexpr unsigned length = sizeof(usbDescriptorHidReport);
+
+	constexpr unsigned input_bits(report_type id) {
+		return hid::report_bits(desc, length, hid::item::input, as_byte(id));
+	}
+
+	// The driver's own configuration descriptor embeds this length, so
+	// it comes from CMake and is only checked here
+	static_assert(length == USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, "USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH does not match the descriptor");
+	static_assert(hid::balanced(desc, length), "Unbalanced collections or truncated item");
+
+#if KEYBOARD_NKRO
+	static_assert(input_bits(report_type::key) == 0, "Key report is replaced by the NKRO report");
+	static_assert(input_bits(report_type::nkro) == hid::payload_bits<nkro_report_t>(), "NKRO report does not match nkro_report_t");
+#else
+	static_assert(input_bits(report_type::key) == hid::payload_bits<key_report_t>(), "Key report does not match key_report_t");
+#endif
+	static_assert(hid::report_bits(desc, length, hid::item::output, as_byte(report_type::key)) == hid::payload_bits<led_report_t>(),
+		"LED report does not match led_report_t");
+#if KEYBOARD_MEDIA_ENDPOINT
+	constexpr auto media_desc = usbDescriptorHidReportMedia;
+	constexpr unsigned media_length = sizeof(usbDescriptorHidReportMedia);
+
+	static_assert(hid::balanced(media_desc, media_length), "Unbalanced collections or truncated item");
+	static_assert(input_bits(report_type::media) == 0 && input_bits(report_type::system) == 0,
+		"Media and system reports belong to the media interface");
+	static_assert(hid::report_bits(media_desc, media_length, hid::item::input, as_byte(report_type::media)) == hid::payload_bits<media_report_t>(),
+		"Media report does not match media_report_t");
+	static_assert(hid::report_bits(media_desc, media_length, hid::item::input, as_byte(report_type::system)) == hid::payload_bits<system_report_t>(),
+		"System report does not match system_report_t");
+#elif KEYBOARD_MEDIA_KEYS
+	static_assert(input_bits(report_type::media) == hid::payload_bits<media_report_t>(), "Media report does not match media_report_t");
+	static_assert(input_bits(report_type::system) == hid::payload_bits<system_report_t>(), "System report does not match system_report_t");
+#endif
+}
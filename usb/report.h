@@ -257,7 +257,12 @@ enum class KeyUsage : uint8_t {
 	VOLUME_UP = 0x80,
 	VOLUME_DOWN = 0x81,
 	// 0x82-0x86
-	// 0x87-0x98 International
+	INTERNATIONAL1 = 0x87, // Ro
+	INTERNATIONAL2 = 0x88, // Katakana/Hiragana
+	INTERNATIONAL3 = 0x89, // Yen
+	INTERNATIONAL4 = 0x8A, // Henkan
+	INTERNATIONAL5 = 0x8B, // Muhenkan
+	// 0x8C-0x98 International
 	// 0x00-0xDD
 	// 0xDE-0xDF Reserved
 	LEFTCTRL = 0xE0,